@@ -9,11 +9,290 @@
 #include <zlib.h>
 #include <pthread.h>
 #include <math.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "thpool.h"
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define COMMON_X86_SIMD
+#include <immintrin.h>
+#endif
 
 
 // ----------------------------------------------------------------------------
 #define FILE_CAP 524
 #define VERSION "2.0.0"
+#define BIT_PATTERN_MAX 64
+
+// Precomputed match masks for the bit-parallel matcher. peq[c] has bit i set
+// when nt_match(needle[i], c), so an IUPAC code in the needle costs nothing. Needles longer than BIT_PATTERN_MAX fall back to the DP.
+typedef struct {
+    const char *needle;
+    size_t len;
+    uint64_t peq[256];
+} Bit_Pattern;
+
+#define NT_PER_WORD 32
+
+// The IUPAC code for each mask of nt_iupac_mask, N for the empty one.
+static const char nt_iupac_letters[17] = "NACMTWYHGRSVKDBN";
+
+// A nucleotide sequence packed 2 bits per base, base i in bits 2 * (i % 32) of
+// bits[i / 32]. Codes come straight from the ASCII bits, (c >> 1) & 3, which
+// gives A=0 C=1 T=2 G=3 in either case, so a base complements to code ^ 2.
+// n_mask has bit i set where seq[i] isn't A, C, G or T (in either case); the
+// code there is meaningless and matches nothing. has_lower is set when some
+// base was lowercase. seq is the text it was packed from.
+typedef struct {
+    uint64_t *bits;
+    uint64_t *n_mask;
+    size_t len;
+    size_t capacity;
+    bool has_lower;
+    const char *seq;
+} Packed_Seq;
+
+#define PATTERN_LANES 4
+
+typedef enum {
+    SIMD_SCALAR = 0,
+    SIMD_SSE41,
+    SIMD_AVX2,
+} Simd_Level;
+
+#define SEED_MIN_LEN 5
+#define SEED_MAX_LEN 32
+
+typedef struct {
+    uint64_t key;
+    uint32_t pattern;
+    bool occupied;
+} Seed_Entry;
+
+// Exact-match seeds for the pigeonhole filter: a pattern with k+1 disjoint
+// pieces keeps at least one piece intact under k edits, so a haystack without a
+// seed hit for a pattern cannot match it. Pieces are taken from the plain ACGT
+// stretches of a pattern; patterns without k+1 of them are flagged in always
+// and never filtered out.
+typedef struct {
+    Seed_Entry *items;
+    size_t capacity;
+    size_t seed_len;
+    size_t k;
+    uint8_t *always;
+    bool enabled;
+} Seed_Index;
+
+#define NEIGHBOURHOOD_MAX_K 2
+#define NEIGHBOURHOOD_MAX_LEN 32
+#define NEIGHBOURHOOD_MAX_ENTRIES (1 << 20)
+
+typedef struct {
+    uint64_t key;
+    uint32_t pattern;
+    uint8_t len;
+    uint8_t dist;
+    bool occupied;
+} Neighbour_Entry;
+
+// Every ACGT sequence within k edits of each pattern, keyed by its packed bases
+// and length, with its edit distance to the pattern. For small k a haystack can
+// then be classified by hash lookups of its windows alone: the best window
+// ending first is exactly the hit the aligner would report. lengths has bit l
+// set when some neighbour has length l.
+typedef struct {
+    Neighbour_Entry *items;
+    size_t capacity;
+    size_t count;
+    size_t k;
+    uint64_t lengths;
+    uint8_t *always;
+    bool has_always;
+    bool enabled;
+} Neighbourhood;
+
+// Rows of the interleaved match masks: one per 2-bit code, then rows that stay
+// zero for masked bases, so row = code | n << 2 needs no branch.
+#define PATTERN_ROWS 8
+
+// A set of bit patterns packed PATTERN_LANES at a time, so that one packed
+// haystack can be searched for all of them in a single pass. peq holds
+// PATTERN_ROWS rows of PATTERN_LANES masks per group.
+typedef struct {
+    const Bit_Pattern **patterns;
+    size_t count;
+    size_t n_groups;
+    uint64_t *peq;
+    uint64_t *high_bits;
+    uint64_t *lens;
+    Simd_Level level;
+    Seed_Index seeds;
+    Neighbourhood neighbours;
+} Pattern_Set;
+
+typedef struct {
+    const char *seq;
+    const char *name;
+    const char *qual;
+    const char *first_slice;
+    const char *last_slice;
+    const char *comment;
+    size_t name_len;
+    size_t comment_len;
+    size_t len;
+} Read;
+
+typedef struct {
+    Read *items;
+    size_t count;
+    size_t capacity;
+} Reads;
+
+// An uncompressed FASTQ file mapped read-only. Reads parsed from it are views
+// into data, so the mapping must outlive every batch that holds them.
+typedef struct {
+    char *data;
+    size_t size;
+} Mapped_File;
+
+#define PIPELINE_DEPTH 3
+
+// Bounded blocking FIFO used to hand batches between pipeline stages. pop
+// returns NULL once the queue is closed and drained.
+typedef struct {
+    void **items;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    bool closed;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} Batch_Queue;
+
+// Counts the outstanding pool jobs of one batch, so a stage can wait for its
+// own work while the pool keeps running jobs of other stages.
+typedef struct {
+    size_t pending;
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+} Latch;
+
+// Backing storage for the records of one batch of reads.
+typedef struct {
+    char *items;
+    size_t count;
+    size_t capacity;
+} Arena;
+
+// A batch of reads whose strings all live in one arena. The Read pointers are
+// rebased whenever the arena grows, and resetting the batch keeps the memory
+// for the next one.
+typedef struct {
+    Reads reads;
+    Arena arena;
+} Read_Batch;
+
+#define GZ_IN_FLIGHT 16
+#define GZ_MEMBER_MAX (16 * 1024 * 1024)
+#define GZ_STREAM_CHUNK (1024 * 1024)
+
+typedef enum {
+    GZ_MEMBER_OK,
+    GZ_MEMBER_FAILED,
+    GZ_MEMBER_TOO_BIG,
+} Gz_Member_Status;
+
+// One gzip member of a multi-member input, inflated on the pool from a
+// candidate header offset. Candidates that turn out not to be members simply
+// fail or are never reached by the chain of member ends.
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    size_t offset;
+    size_t end;
+    uint8_t *out;
+    size_t out_len;
+    size_t out_cap;
+    Gz_Member_Status status;
+    Latch latch;
+} Gz_Member;
+
+// Input stream for kseq. Gzip files are mapped and their first member is
+// inflated in place on the reading thread, like gzread would. Once a BGZF
+// block or a second member shows the file is multi-member, parallel is set and
+// the members are inflated on the pool, then handed out in file order starting
+// from the member at pos. A member that can't be used (too big, or no job at
+// pos) is still inflated in place. Plain files go through gzread.
+typedef struct {
+    gzFile gz;
+    Mapped_File map;
+    threadpool pool;
+    Gz_Member members[GZ_IN_FLIGHT];
+    size_t head;
+    size_t pending;
+    size_t next_candidate;
+    size_t pos;
+    bool consuming;
+    const uint8_t *out;
+    size_t out_len;
+    z_stream stream;
+    bool streaming;
+    uint8_t *stream_buf;
+    bool parallel;
+    bool failed;
+} Gz_Reader;
+
+// Formatted records collect in a caller-owned buffer and go to the writer once
+// it holds this much.
+#define FASTQ_FLUSH_SIZE (1 << 20)
+
+#define BGZF_BLOCK_SIZE 0xff00
+#define BGZF_MAX_BLOCK_SIZE 0x10000
+#define BGZF_HEADER_SIZE 18
+#define BGZF_FOOTER_SIZE 8
+#define BGZF_IN_FLIGHT 8
+
+// One block of a BGZF stream: up to BGZF_BLOCK_SIZE bytes of input deflated on
+// their own into a complete gzip member carrying its size in the BC field.
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    uint8_t *out;
+    size_t out_len;
+    int level;
+    bool failed;
+    Latch latch;
+} Bgzf_Block;
+
+typedef struct {
+    uint64_t compressed;
+    uint64_t uncompressed;
+} Bgzf_Index_Entry;
+
+typedef struct {
+    Bgzf_Index_Entry *items;
+    size_t count;
+    size_t capacity;
+} Bgzf_Index;
+
+// Block-compressed gzip writer. Full blocks are deflated on the pool while the
+// caller fills the next ones and are written out in order, so the output is a
+// plain multi-member gzip file. At most BGZF_IN_FLIGHT blocks are outstanding;
+// blocks[head] is the oldest and the block after the pending ones is filling.
+typedef struct {
+    FILE *fp;
+    char *path;
+    threadpool pool;
+    int level;
+    Bgzf_Block blocks[BGZF_IN_FLIGHT];
+    size_t head;
+    size_t pending;
+    uint64_t compressed_offset;
+    uint64_t uncompressed_offset;
+    bool write_index;
+    Bgzf_Index index;
+    bool failed;
+} Bgzf_Writer;
 
 typedef struct {
     char *name;
@@ -26,8 +305,13 @@ typedef struct {
     char *rv_comp;  
     size_t rv_length;
 
+    Bit_Pattern fw_pattern;
+    Bit_Pattern fw_comp_pattern;
+    Bit_Pattern rv_pattern;
+    Bit_Pattern rv_comp_pattern;
+
     char out_name[512];
-    gzFile out_gz;
+    Bgzf_Writer *out;
 
     size_t counter;
 } Barcode;
@@ -38,38 +322,101 @@ typedef struct{
     size_t capacity;
 } Barcodes;
 
+// Marks a tag value naming several barcode rows.
+#define TAG_SHARED -2
+
 typedef struct {
-    const char *seq;
-    const char *name;
-    const char *qual;
-    const char *first_slice;
-    const char *last_slice;
+    const char *value;
     size_t len;
-} Read;
+    int barcode;
+    bool occupied;
+} Tag_Entry;
 
+// Barcode rows keyed by name, for reads a basecaller has already classified
+// and tagged in the FASTQ header. Values point at the barcode names.
 typedef struct {
-    Read *items;
-    size_t count;
+    Tag_Entry *items;
     size_t capacity;
-} Reads;
+} Tag_Table;
 
-bool append_read_to_gzip_fastq(gzFile gzfp, Read *read, int start, int end);
+void fastq_append_record(Nob_String_Builder *buf, const char *name, size_t name_len, const char *seq, const char *qual, size_t len);
+bool append_read_to_gzip_fastq(Bgzf_Writer *out, Nob_String_Builder *buf, Read *read, int start, int end);
+bool flush_fastq_buffer(Bgzf_Writer *out, Nob_String_Builder *buf);
 void print_barcode_documentation(void);
 void slice_str(const char * str, char * buffer, size_t start, size_t end);
 void slice(const char* src, char* dest, size_t start, size_t end);
 char complement(const char nucleotide);
 void complement_sequence(char *src, char *dest, size_t length);
-bool parse_barcodes(const char *bc_path, Barcodes *barcodes, Nob_String_Builder *sb, char *outdir);
+static inline int nt_code(char c);
+static inline bool nt_is_base(char c);
+static inline unsigned nt_iupac_mask(char c);
+static inline bool nt_match(char pattern, char base);
+static inline char nt_first_non_iupac(const char *seq, size_t len);
+bool packed_seq_reserve(Packed_Seq *ps, size_t len);
+bool packed_seq_pack(Packed_Seq *ps, const char *seq, size_t len);
+bool packed_seq_revcomp(const Packed_Seq *src, Packed_Seq *dest);
+void packed_seq_unpack(const Packed_Seq *ps, char *dest);
+bool packed_seq_has_n(const Packed_Seq *ps);
+uint64_t packed_seq_hash(const Packed_Seq *ps);
+void packed_seq_free(Packed_Seq *ps);
+bool parse_barcodes(const char *bc_path, Barcodes *barcodes, Nob_String_Builder *sb, char *outdir, threadpool compress_pool, bool write_index);
 int parse_csv_headers(const char *barcode_path);
-void close_gz_files(Barcode *bc);
+bool close_gz_files(Barcode *bc);
 void free_barcode(Barcode *bc);
 static inline int min(int a, int b, int c);
+static inline size_t min_size(size_t a, size_t b, size_t c);
 int levenshtein_distance(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len, size_t k);
+int levenshtein_distance_dp(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len, size_t k);
+int barcode_distance(const char *a, size_t a_len, const char *b, size_t b_len);
+int levenshtein_distance_cutoff(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len, size_t k);
+int levenshtein_best_cutoff(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len, size_t k, int *dist);
+void bit_pattern_init(Bit_Pattern *pattern, const char *needle, size_t needle_len);
+int bit_parallel_distance(const char *haystack, size_t haystack_len, const Bit_Pattern *pattern, size_t k);
+int bit_parallel_best(const char *haystack, size_t haystack_len, const Bit_Pattern *pattern, size_t k, int *dist);
+Simd_Level simd_level_detect(void);
+const char *simd_level_name(Simd_Level level);
+bool pattern_set_init(Pattern_Set *set, const Bit_Pattern **patterns, size_t count);
+void pattern_set_free(Pattern_Set *set);
+void pattern_set_search(const Pattern_Set *set, const Packed_Seq *haystack, size_t k, int *ends, int *dists);
+bool pattern_set_build_seed_index(Pattern_Set *set, size_t k);
+bool pattern_set_build_neighbourhood(Pattern_Set *set, size_t k, size_t max_entries);
+bool neighbourhood_search(const Neighbourhood *nb, const Pattern_Set *set, const Packed_Seq *haystack, int *ends, int *dists);
+void seed_index_candidates(const Seed_Index *index, size_t n_patterns, const Packed_Seq *haystack, uint8_t *candidates);
 FILE* open_summary_file(const char *out_folder, const char *filename);
-void free_read(Read read);
+bool batch_queue_init(Batch_Queue *q, size_t capacity);
+void batch_queue_destroy(Batch_Queue *q);
+void batch_queue_push(Batch_Queue *q, void *item);
+void *batch_queue_pop(Batch_Queue *q);
+void batch_queue_close(Batch_Queue *q);
+void latch_init(Latch *latch);
+void latch_destroy(Latch *latch);
+void latch_add(Latch *latch, size_t n);
+void latch_done(Latch *latch);
+void latch_wait(Latch *latch);
+Read *read_batch_push(Read_Batch *batch, const char *name, size_t name_len, const char *comment, size_t comment_len, const char *seq, const char *qual, size_t len);
+void read_batch_reset(Read_Batch *batch);
+void read_batch_free(Read_Batch *batch);
+bool is_gzip_file(const char *path);
+bool mapped_file_open(Mapped_File *mf, const char *path);
+void mapped_file_close(Mapped_File *mf);
+int fastq_next_record(const char **pos, const char *end, Read *read);
+size_t fastq_split_ranges(const char *data, size_t size, size_t n, size_t *bounds);
+const char *header_tag(const char *comment, size_t comment_len, const char *key, size_t key_len, size_t *value_len);
+bool tag_table_init(Tag_Table *table, const Barcodes *barcodes);
+int tag_table_lookup(const Tag_Table *table, const char *value, size_t len);
+void tag_table_free(Tag_Table *table);
+Gz_Reader *gz_reader_open(const char *path, threadpool pool);
+int gz_reader_read(Gz_Reader *r, void *buf, int len);
+void gz_reader_close(Gz_Reader *r);
+Bgzf_Writer *bgzf_open(const char *path, const char *mode, threadpool pool, bool write_index);
+bool bgzf_write(Bgzf_Writer *w, const void *data, size_t len);
+bool bgzf_close(Bgzf_Writer *w);
 char *basename(char const *path);
+double phred_error_sum(const char *quals, size_t len);
+double phred_error_sum_level(const char *quals, size_t len, Simd_Level level);
 double average_qual(const char *quals, size_t len);
 bool is_fastq(const char *file);
+bool collect_fastq_inputs(const char *input, Nob_File_Paths *paths);
 bool must_be_digit(const char *arg);
 void print_version(void);
 
@@ -79,15 +426,11 @@ void print_version(void);
 
 #ifdef COMMON_IMPLEMENTATION
 
+// Complements any IUPAC code; other bytes become N.
 char complement(const char nucleotide) 
 {
-    switch (nucleotide) {
-        case 'A': return 'T';
-        case 'T': return 'A';
-        case 'C': return 'G';
-        case 'G': return 'C';
-        default: return 'N'; 
-    }
+    unsigned mask = nt_iupac_mask(nucleotide);
+    return mask ? nt_iupac_letters[((mask << 2) | (mask >> 2)) & 15] : 'N';
 }
 
 void complement_sequence(char *src, char *dest, size_t length) 
@@ -98,7 +441,244 @@ void complement_sequence(char *src, char *dest, size_t length)
     dest[length] = '\0';
 }
 
-bool parse_barcodes(const char *bc_path, Barcodes *barcodes, Nob_String_Builder *sb, char *outdir)
+// ---- 2-bit nucleotides ----
+
+static inline int nt_code(char c)
+{
+    return (c >> 1) & 3;
+}
+
+// A, C, G and T sit at bits 0, 2, 6 and 19 counting from 'A' once the case bit
+// is cleared.
+static inline bool nt_is_base(char c)
+{
+    unsigned offset = (unsigned)((unsigned char)c & 0xDF) - 'A';
+    return offset < 20 && ((0x80045u >> offset) & 1);
+}
+
+// The bases an IUPAC code stands for, one bit per 2-bit code (A=1 C=2 T=4
+// G=8), in either case; 0 for bytes that aren't codes. U reads as T.
+static inline unsigned nt_iupac_mask(char c)
+{
+    static const uint8_t masks[26] = {
+        ['A' - 'A'] = 1, ['B' - 'A'] = 14, ['C' - 'A'] = 2, ['D' - 'A'] = 13, ['G' - 'A'] = 8,
+        ['H' - 'A'] = 7, ['K' - 'A'] = 12, ['M' - 'A'] = 3, ['N' - 'A'] = 15, ['R' - 'A'] = 9,
+        ['S' - 'A'] = 10, ['T' - 'A'] = 4, ['U' - 'A'] = 4, ['V' - 'A'] = 11, ['W' - 'A'] = 5,
+        ['Y' - 'A'] = 6,
+    };
+    unsigned offset = (unsigned)((unsigned char)c & 0xDF) - 'A';
+    return offset < 26 ? masks[offset] : 0;
+}
+
+// The first byte of seq that isn't an IUPAC code, or 0 when they all are.
+static inline char nt_first_non_iupac(const char *seq, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (nt_iupac_mask(seq[i]) == 0) return seq[i] ? seq[i] : '?';
+    }
+    return 0;
+}
+
+// Whether a read base matches a pattern base, which may be any IUPAC code.
+// Read bases other than A, C, G and T match nothing.
+static inline bool nt_match(char pattern, char base)
+{
+    return nt_is_base(base) && ((nt_iupac_mask(pattern) >> nt_code(base)) & 1);
+}
+
+static inline int packed_seq_code(const Packed_Seq *ps, size_t i)
+{
+    return (int)(ps->bits[i / NT_PER_WORD] >> (2 * (i % NT_PER_WORD))) & 3;
+}
+
+static inline bool packed_seq_is_n(const Packed_Seq *ps, size_t i)
+{
+    return (ps->n_mask[i / 64] >> (i % 64)) & 1;
+}
+
+// Row of the pattern set match masks for base i.
+static inline size_t packed_seq_row(const Packed_Seq *ps, size_t i)
+{
+    return (size_t)packed_seq_code(ps, i) | (size_t)packed_seq_is_n(ps, i) << 2;
+}
+
+static inline size_t packed_words(size_t len)
+{
+    return (len + NT_PER_WORD - 1) / NT_PER_WORD;
+}
+
+static inline size_t packed_mask_words(size_t len)
+{
+    return (len + 63) / 64;
+}
+
+// Makes room for len bases. Capacity is kept a multiple of 64 bases so both
+// arrays are whole words.
+bool packed_seq_reserve(Packed_Seq *ps, size_t len)
+{
+    if (len <= ps->capacity && ps->bits) return true;
+    size_t capacity = ps->capacity ? ps->capacity : 256;
+    while (capacity < len) capacity *= 2;
+    uint64_t *bits = realloc(ps->bits, packed_words(capacity) * sizeof(uint64_t));
+    if (!bits) return false;
+    ps->bits = bits;
+    uint64_t *n_mask = realloc(ps->n_mask, packed_mask_words(capacity) * sizeof(uint64_t));
+    if (!n_mask) return false;
+    ps->n_mask = n_mask;
+    ps->capacity = capacity;
+    return true;
+}
+
+// Codes beyond len are kept zero so that packed sequences of one length
+// compare and hash word by word.
+static void packed_seq_clear_tail(Packed_Seq *ps)
+{
+    if (ps->len % NT_PER_WORD) ps->bits[ps->len / NT_PER_WORD] &= ((uint64_t)1 << (2 * (ps->len % NT_PER_WORD))) - 1;
+    if (ps->len % 64) ps->n_mask[ps->len / 64] &= ((uint64_t)1 << (ps->len % 64)) - 1;
+}
+
+#ifdef COMMON_X86_SIMD
+// Packs 16 bases: returns their 32 code bits and sets *n_mask and *lower to one
+// bit per base. SSE2 is part of x86-64, so this needs no dispatch.
+static inline uint32_t nt_pack16_sse2(const char *seq, uint32_t *n_mask, uint32_t *lower)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)seq);
+    __m128i up = _mm_and_si128(v, _mm_set1_epi8((char)0xDF));
+    __m128i base = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(up, _mm_set1_epi8('A')), _mm_cmpeq_epi8(up, _mm_set1_epi8('C'))),
+                                _mm_or_si128(_mm_cmpeq_epi8(up, _mm_set1_epi8('G')), _mm_cmpeq_epi8(up, _mm_set1_epi8('T'))));
+    __m128i case_bit = _mm_set1_epi8(0x20);
+    *n_mask = ~(uint32_t)_mm_movemask_epi8(base) & 0xFFFF;
+    *lower = (uint32_t)_mm_movemask_epi8(_mm_and_si128(base, _mm_cmpeq_epi8(_mm_and_si128(v, case_bit), case_bit)));
+
+    // gather the 2-bit codes of neighbouring bytes, then of neighbouring
+    // 16- and 32-bit lanes, until each 64-bit lane holds 8 codes
+    __m128i x = _mm_and_si128(_mm_srli_epi16(v, 1), _mm_set1_epi8(3));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_srli_epi16(x, 6)), _mm_set1_epi16(0x000F));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_srli_epi32(x, 12)), _mm_set1_epi32(0x00FF));
+    x = _mm_or_si128(x, _mm_srli_epi64(x, 24));
+    uint64_t lo = (uint64_t)_mm_cvtsi128_si64(x) & 0xFFFF;
+    uint64_t hi = (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(x, x)) & 0xFFFF;
+    return (uint32_t)(lo | hi << 16);
+}
+#endif // COMMON_X86_SIMD
+
+bool packed_seq_pack(Packed_Seq *ps, const char *seq, size_t len)
+{
+    if (!packed_seq_reserve(ps, len)) return false;
+    ps->len = len;
+    ps->seq = seq;
+    ps->has_lower = false;
+    memset(ps->bits, 0, packed_words(len) * sizeof(uint64_t));
+    memset(ps->n_mask, 0, packed_mask_words(len) * sizeof(uint64_t));
+
+    size_t i = 0;
+#ifdef COMMON_X86_SIMD
+    uint32_t any_lower = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint32_t n_mask, lower;
+        uint32_t codes = nt_pack16_sse2(seq + i, &n_mask, &lower);
+        ps->bits[i / NT_PER_WORD] |= (uint64_t)codes << (2 * (i % NT_PER_WORD));
+        ps->n_mask[i / 64] |= (uint64_t)n_mask << (i % 64);
+        any_lower |= lower;
+    }
+    ps->has_lower = any_lower != 0;
+#endif
+    for (; i < len; i++) {
+        char c = seq[i];
+        ps->bits[i / NT_PER_WORD] |= (uint64_t)nt_code(c) << (2 * (i % NT_PER_WORD));
+        if (!nt_is_base(c)) ps->n_mask[i / 64] |= (uint64_t)1 << (i % 64);
+        else if (c & 0x20) ps->has_lower = true;
+    }
+    return true;
+}
+
+static inline uint64_t reverse_bit_pairs(uint64_t x)
+{
+    x = __builtin_bswap64(x);
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    return ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+}
+
+static inline uint64_t reverse_bits(uint64_t x)
+{
+    x = reverse_bit_pairs(x);
+    return ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+}
+
+// Reverses words in place and shifts the result down by the padding the
+// reversal moved to the bottom.
+static void reverse_words(uint64_t *words, size_t n, size_t pad_bits, uint64_t (*reverse)(uint64_t))
+{
+    for (size_t i = 0; i < n / 2; i++) {
+        uint64_t t = reverse(words[i]);
+        words[i] = reverse(words[n - 1 - i]);
+        words[n - 1 - i] = t;
+    }
+    if (n % 2) words[n / 2] = reverse(words[n / 2]);
+    if (pad_bits == 0) return;
+    for (size_t i = 0; i < n; i++) {
+        words[i] = (words[i] >> pad_bits) | (i + 1 < n ? words[i + 1] << (64 - pad_bits) : 0);
+    }
+}
+
+// Reverse complement by bit tricks: code pairs reversed a word at a time and
+// every code flipped with ^ 2. Masked bases stay masked.
+bool packed_seq_revcomp(const Packed_Seq *src, Packed_Seq *dest)
+{
+    size_t len = src->len;
+    if (!packed_seq_reserve(dest, len)) return false;
+    size_t words = packed_words(len);
+    size_t mask_words = packed_mask_words(len);
+    memmove(dest->bits, src->bits, words * sizeof(uint64_t));
+    memmove(dest->n_mask, src->n_mask, mask_words * sizeof(uint64_t));
+    dest->len = len;
+    dest->has_lower = src->has_lower;
+    dest->seq = NULL;
+    if (len == 0) return true;
+
+    reverse_words(dest->bits, words, 2 * (words * NT_PER_WORD - len), reverse_bit_pairs);
+    for (size_t i = 0; i < words; i++) dest->bits[i] ^= 0xAAAAAAAAAAAAAAAAULL;
+    reverse_words(dest->n_mask, mask_words, mask_words * 64 - len, reverse_bits);
+    packed_seq_clear_tail(dest);
+    return true;
+}
+
+// Writes the bases as uppercase text, N where masked, and terminates it.
+// n_mask may be NULL for a sequence known to have no masked bases.
+void packed_seq_unpack(const Packed_Seq *ps, char *dest)
+{
+    for (size_t i = 0; i < ps->len; i++) {
+        dest[i] = ps->n_mask && packed_seq_is_n(ps, i) ? 'N' : "ACTG"[packed_seq_code(ps, i)];
+    }
+    dest[ps->len] = '\0';
+}
+
+bool packed_seq_has_n(const Packed_Seq *ps)
+{
+    for (size_t i = 0; i < packed_mask_words(ps->len); i++) {
+        if (ps->n_mask[i]) return true;
+    }
+    return false;
+}
+
+uint64_t packed_seq_hash(const Packed_Seq *ps)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ ps->len;
+    for (size_t i = 0; i < packed_words(ps->len); i++) {
+        h = (h ^ ps->bits[i]) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+void packed_seq_free(Packed_Seq *ps)
+{
+    free(ps->bits);
+    free(ps->n_mask);
+    memset(ps, 0, sizeof(*ps));
+}
+
+bool parse_barcodes(const char *bc_path, Barcodes *barcodes, Nob_String_Builder *sb, char *outdir, threadpool compress_pool, bool write_index)
 {
     if (!nob_read_entire_file(bc_path, sb)) return false;
 
@@ -120,6 +700,10 @@ bool parse_barcodes(const char *bc_path, Barcodes *barcodes, Nob_String_Builder
             Nob_String_View field = nob_sv_chop_by_delim(&line, ',');
             const char *field_cstr = nob_temp_sv_to_cstr(field);
             size_t field_len = strlen(field_cstr);
+            char invalid = i > 0 ? nt_first_non_iupac(field_cstr, field_len) : 0;
+            if (invalid) {
+                nob_log(NOB_WARNING, "Barcode %s contains '%c', which is not an IUPAC nucleotide code and matches nothing", barcode.name, invalid);
+            }
             
             switch (i) {
                 case 0:
@@ -135,6 +719,8 @@ bool parse_barcodes(const char *bc_path, Barcodes *barcodes, Nob_String_Builder
                         return false;
                     }
                     complement_sequence(barcode.fw, barcode.fw_comp, barcode.fw_length);
+                    bit_pattern_init(&barcode.fw_pattern, barcode.fw, barcode.fw_length);
+                    bit_pattern_init(&barcode.fw_comp_pattern, barcode.fw_comp, barcode.fw_length);
                     break;
                 case 2:
                     barcode.rv_length = strlen(field_cstr);
@@ -148,6 +734,8 @@ bool parse_barcodes(const char *bc_path, Barcodes *barcodes, Nob_String_Builder
                         return false;
                     }
                     complement_sequence(barcode.rv, barcode.rv_comp, barcode.rv_length);
+                    bit_pattern_init(&barcode.rv_pattern, barcode.rv, barcode.rv_length);
+                    bit_pattern_init(&barcode.rv_comp_pattern, barcode.rv_comp, barcode.rv_length);
                     break;
                 default: 
                     printf("ERROR: your barcodes contains %zu fields. It should be 3.\n", i + 1);
@@ -157,8 +745,8 @@ bool parse_barcodes(const char *bc_path, Barcodes *barcodes, Nob_String_Builder
         }
         // add the new gz file to write to later.
         snprintf(barcode.out_name, sizeof(barcode.out_name), "%s/%s.fq.gz", outdir, barcode.name);
-        barcode.out_gz = gzopen(barcode.out_name, "ab");
-        if (!barcode.out_gz) {
+        barcode.out = bgzf_open(barcode.out_name, "ab", compress_pool, write_index);
+        if (!barcode.out) {
             printf("ERROR: Could not open %s to write to\n", barcode.out_name);
             return false;
         }
@@ -167,9 +755,12 @@ bool parse_barcodes(const char *bc_path, Barcodes *barcodes, Nob_String_Builder
     return true;
 }
 
-void close_gz_files(Barcode *bc)
+bool close_gz_files(Barcode *bc)
 {
-    if (bc->out_gz) gzclose(bc->out_gz);
+    bool ok = true;
+    if (bc->out) ok = bgzf_close(bc->out);
+    bc->out = NULL;
+    return ok;
 }
 
 void free_barcode(Barcode *bc)
@@ -191,11 +782,28 @@ void print_barcode_documentation(void)
     printf("Single barcode example:\n");
     printf("name,forward\n");
     printf("barcode1,ACTATCTACTA\n");
-    printf("barcode2,AGCGTATGCTGGTA\n");
+    printf("barcode2,AGCGTATGCTGGTA\n\n");
+    printf("Barcodes may contain IUPAC codes such as N or R, which match any base they stand for.\n");
 }
 
-// https://stackoverflow.com/questions/8139958/algorithm-to-find-edit-distance-to-all-substrings
+// Returns the first end position j (needle_len <= j <= haystack_len) where the
+// needle matches a substring of the haystack ending at j with at most k edits,
+// or -1 if there is none. Needles up to BIT_PATTERN_MAX use the bit-parallel
+// matcher, longer ones the cut-off DP.
 int levenshtein_distance(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len, size_t k) 
+{
+    if (k > needle_len) return -1;
+    if (needle_len == 0 || needle_len > BIT_PATTERN_MAX) {
+        return levenshtein_distance_cutoff(haystack, haystack_len, needle, needle_len, k);
+    }
+
+    Bit_Pattern pattern;
+    bit_pattern_init(&pattern, needle, needle_len);
+    return bit_parallel_distance(haystack, haystack_len, &pattern, k);
+}
+
+// https://stackoverflow.com/questions/8139958/algorithm-to-find-edit-distance-to-all-substrings
+int levenshtein_distance_dp(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len, size_t k) 
 {
     if (k > needle_len) return -1;
     
@@ -208,7 +816,7 @@ int levenshtein_distance(const char *haystack, size_t haystack_len, const char *
     for (size_t i = 1; i <= needle_len; i++) {
         dp[i][0] = i;
         for (size_t j = 1; j <= haystack_len; j++) {
-            if (needle[i - 1] == haystack[j - 1]) {
+            if (nt_match(needle[i - 1], haystack[j - 1])) {
                 dp[i][j] = dp[i - 1][j - 1];
             } else {
                 dp[i][j] = 1 + min(dp[i - 1][j], dp[i][j - 1], dp[i - 1][j - 1]);
@@ -222,97 +830,1761 @@ int levenshtein_distance(const char *haystack, size_t haystack_len, const char *
     return -1;
 }
 
-static inline int min(int a, int b, int c) 
+// Edit distance between two whole barcodes. Bases match when the codes share
+// a base, so a degenerate position is as close as it can be to either side.
+int barcode_distance(const char *a, size_t a_len, const char *b, size_t b_len)
 {
-    int min = a;
-    if (b < min) {
-        min = b;
+    size_t row[b_len + 1];
+    for (size_t j = 0; j <= b_len; j++) row[j] = j;
+    for (size_t i = 1; i <= a_len; i++) {
+        size_t diag = row[0];
+        row[0] = i;
+        for (size_t j = 1; j <= b_len; j++) {
+            size_t up = row[j];
+            if (nt_iupac_mask(a[i - 1]) & nt_iupac_mask(b[j - 1])) row[j] = diag;
+            else row[j] = 1 + min_size(row[j], row[j - 1], diag);
+            diag = up;
+        }
     }
-    if (c < min) {
-        min = c;
+    return (int)row[b_len];
+}
+
+void bit_pattern_init(Bit_Pattern *pattern, const char *needle, size_t needle_len)
+{
+    memset(pattern->peq, 0, sizeof(pattern->peq));
+    pattern->needle = needle;
+    pattern->len = needle_len;
+    if (needle_len > BIT_PATTERN_MAX) return;
+    for (size_t i = 0; i < needle_len; i++) {
+        unsigned mask = nt_iupac_mask(needle[i]);
+        for (int code = 0; code < 4; code++) {
+            if (!(mask & (1u << code))) continue;
+            char upper = "ACTG"[code];
+            pattern->peq[(unsigned char)upper] |= (uint64_t)1 << i;
+            pattern->peq[(unsigned char)(upper | 0x20)] |= (uint64_t)1 << i;
+        }
     }
-    return min;
 }
 
-int parse_csv_headers(const char *barcode_path) 
+// Myers' bit-vector algorithm (Hyyro's formulation) for semi-global matching:
+// the needle must be matched in full, but may start anywhere in the haystack.
+// Vertical deltas of one DP column are kept in Pv/Mv, and score tracks the
+// last row, i.e. the edit distance of the needle ending at the current column.
+// Same contract as levenshtein_distance_dp.
+int bit_parallel_distance(const char *haystack, size_t haystack_len, const Bit_Pattern *pattern, size_t k)
 {
-    FILE *f = fopen(barcode_path, "r");
-    if (!f) {
-        printf("Error: couldn't open file\n");
-        return -1;
+    size_t m = pattern->len;
+    if (k > m) return -1;
+    if (m == 0 || m > BIT_PATTERN_MAX) {
+        return levenshtein_distance_cutoff(haystack, haystack_len, pattern->needle, m, k);
     }
-    
-    char cols[10][100];  
-    int count = 0;
-    int c;
-    
-    while (fscanf(f, "%99[^,\n]", cols[count]) == 1) {
-        count++;
-        if (count >= 10) break;
-        c = fgetc(f);
-        if (c == '\n' || c == EOF) break;
+
+    uint64_t pv = ~(uint64_t)0;
+    uint64_t mv = 0;
+    uint64_t high_bit = (uint64_t)1 << (m - 1);
+    size_t score = m;
+
+    for (size_t j = 0; j < haystack_len; j++) {
+        uint64_t eq = pattern->peq[(unsigned char)haystack[j]];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+
+        if (ph & high_bit) score++;
+        else if (mh & high_bit) score--;
+
+        // the first DP row is all zeros, so no carry is shifted into ph
+        ph <<= 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+
+        if (j + 1 >= m && score <= k) return (int)(j + 1);
     }
-    
-    fclose(f);
+    return -1;
+}
 
-    if (!(count == 2 || count == 3)) {
-        printf("ERROR: Wrong amount of barcode headers\n");
-        print_barcode_documentation();
-        return -1;
+// Ukkonen's cut-off over the same DP, one haystack column at a time. Only rows
+// down to the last one within k are filled: a row below it can't drop to k
+// before the active part has grown down to it, and that grows by at most one
+// row per column. Values within k are exact and everything else only counts
+// as more than k, so the answers match the full DP at O(k) expected cells per
+// column instead of O(needle_len). best selects the lowest distance over all
+// end positions, otherwise levenshtein_distance_dp's first end within k.
+static int levenshtein_cutoff(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len, size_t k, bool best, int *dist)
+{
+    *dist = -1;
+    if (k > needle_len) return -1;
+    size_t m = needle_len;
+    if (m == 0) {
+        *dist = 0;
+        return 0;
     }
 
-    // single barcode
-    if (count == 2) {
-        if (strcmp(cols[0], "name") != 0 || strcmp(cols[1], "forward") != 0) {
-            printf("ERROR: Headers of barcode file have incorrect headers\n");
-            print_barcode_documentation();
-            return -1;
+    size_t col[m + 1];
+    for (size_t i = 0; i <= m; i++) col[i] = i;
+    size_t last = k;
+    size_t best_dist = k + 1;
+    int best_end = -1;
+
+    for (size_t j = 1; j <= haystack_len; j++) {
+        char c = haystack[j - 1];
+        size_t rows = last < m ? last + 1 : m;
+        size_t diag = col[0];
+        for (size_t i = 1; i <= rows; i++) {
+            size_t left = i <= last ? col[i] : k + 1;
+            col[i] = nt_match(needle[i - 1], c) ? diag : 1 + min_size(left, col[i - 1], diag);
+            diag = left;
         }
-        return 1;
-    // dual barcode
-    } else {
-        if (strcmp(cols[0], "name") != 0 || strcmp(cols[1], "forward") != 0 || strcmp(cols[2], "reverse") != 0) {
-            printf("ERROR: Headers of barcode file have incorrect headers\n");
-            print_barcode_documentation();
-            return -1;
+        last = rows;
+        while (col[last] > k) last--;
+
+        if (last == m && j >= m && col[m] < best_dist) {
+            best_dist = col[m];
+            best_end = (int)j;
+            if (!best || best_dist == 0) break;
         }
-       return 2; 
     }
-    //UNREACHABLE
+    if (best_end != -1) *dist = (int)best_dist;
+    return best_end;
 }
 
-void slice(const char* src, char* dest, size_t start, size_t end) 
+int levenshtein_distance_cutoff(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len, size_t k)
 {
-    size_t length = end - start;
-    memcpy(dest, src + start, length);
-    dest[length] = '\0';  
+    int dist;
+    return levenshtein_cutoff(haystack, haystack_len, needle, needle_len, k, false, &dist);
 }
 
-FILE* open_summary_file(const char *out_folder, const char *filename) 
+int levenshtein_best_cutoff(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len, size_t k, int *dist)
 {
-    char summary_file[FILE_CAP];
-    snprintf(summary_file, sizeof(summary_file), "%s/%s", out_folder, filename);
-    
-    FILE *S_FILE = fopen(summary_file, "ab");
-    if (S_FILE == NULL) {
-        nob_log(NOB_ERROR, "Could NOT create summary file");
-        return NULL;
-    }
-    
-    return S_FILE;
+    return levenshtein_cutoff(haystack, haystack_len, needle, needle_len, k, true, dist);
 }
 
-
-void free_read(Read read) 
+// Best hit of the needle in the haystack: returns the first end position with
+// the lowest edit distance, which goes to dist, or -1 (and dist -1) if no end
+// is within k edits. Unlike bit_parallel_distance it scans the whole haystack
+// unless an exact match turns up.
+int bit_parallel_best(const char *haystack, size_t haystack_len, const Bit_Pattern *pattern, size_t k, int *dist)
 {
-    free((void *)read.seq);
-    free((void *)read.name);
-    free((void *)read.qual);
-    free((void *)read.first_slice);
-    free((void *)read.last_slice);
+    size_t m = pattern->len;
+    *dist = -1;
+    if (k > m) return -1;
+    if (m == 0 || m > BIT_PATTERN_MAX) {
+        return levenshtein_best_cutoff(haystack, haystack_len, pattern->needle, m, k, dist);
+    }
+
+    uint64_t pv = ~(uint64_t)0;
+    uint64_t mv = 0;
+    uint64_t high_bit = (uint64_t)1 << (m - 1);
+    size_t score = m;
+    size_t best = k + 1;
+    int best_end = -1;
+
+    for (size_t j = 0; j < haystack_len && best > 0; j++) {
+        uint64_t eq = pattern->peq[(unsigned char)haystack[j]];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+
+        if (ph & high_bit) score++;
+        else if (mh & high_bit) score--;
+
+        ph <<= 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+
+        if (j + 1 >= m && score < best) {
+            best = score;
+            best_end = (int)(j + 1);
+        }
+    }
+    if (best_end != -1) *dist = (int)best;
+    return best_end;
+}
+
+Simd_Level simd_level_detect(void)
+{
+#ifdef COMMON_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return SIMD_SSE41;
+#endif
+    return SIMD_SCALAR;
+}
+
+const char *simd_level_name(Simd_Level level)
+{
+    switch (level) {
+        case SIMD_AVX2: return "avx2";
+        case SIMD_SSE41: return "sse4.1";
+        default: return "scalar";
+    }
+}
+
+static inline size_t seed_hash(uint64_t key, size_t capacity)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (size_t)key & (capacity - 1);
+}
+
+static bool seed_pack(const char *seq, size_t len, uint64_t *key)
+{
+    uint64_t k = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!nt_is_base(seq[i])) return false;
+        k = (k << 2) | (uint64_t)nt_code(seq[i]);
+    }
+    *key = k;
+    return true;
+}
+
+// Takes up to max disjoint plain ACGT pieces of seed_len from the needle,
+// skipping degenerate bases, and packs them into keys if given. Any k + 1
+// disjoint pieces will do for the filter. Returns how many were found.
+static size_t seed_pieces(const char *needle, size_t len, size_t seed_len, uint64_t *keys, size_t max)
+{
+    size_t pieces = 0;
+    for (size_t start = 0; pieces < max && start + seed_len <= len; ) {
+        uint64_t key;
+        if (seed_pack(needle + start, seed_len, &key)) {
+            if (keys) keys[pieces] = key;
+            pieces++;
+            start += seed_len;
+        } else {
+            start++;
+        }
+    }
+    return pieces;
+}
+
+bool pattern_set_build_seed_index(Pattern_Set *set, size_t k)
+{
+    Seed_Index *index = &set->seeds;
+    memset(index, 0, sizeof(*index));
+    index->k = k;
+    if (set->count == 0) return true;
+
+    // patterns with pieces shorter than SEED_MIN_LEN would hit almost every read
+    // window, so they are always aligned instead of being indexed
+    size_t seed_len = SEED_MAX_LEN + 1;
+    for (size_t p = 0; p < set->count; p++) {
+        const Bit_Pattern *pattern = set->patterns[p];
+        size_t piece_len = pattern->len / (k + 1);
+        if (piece_len > SEED_MAX_LEN) piece_len = SEED_MAX_LEN;
+        while (piece_len >= SEED_MIN_LEN && seed_pieces(pattern->needle, pattern->len, piece_len, NULL, k + 1) <= k) piece_len--;
+        if (piece_len >= SEED_MIN_LEN && piece_len < seed_len) seed_len = piece_len;
+    }
+    if (seed_len > SEED_MAX_LEN) seed_len = SEED_MAX_LEN;
+    index->seed_len = seed_len;
+
+    index->capacity = 16;
+    while (index->capacity < 2 * set->count * (k + 1)) index->capacity *= 2;
+    index->items = calloc(index->capacity, sizeof(Seed_Entry));
+    index->always = calloc(set->count, sizeof(uint8_t));
+    if (!index->items || !index->always) {
+        free(index->items);
+        free(index->always);
+        memset(index, 0, sizeof(*index));
+        return false;
+    }
+
+    size_t indexed = 0;
+    for (size_t p = 0; p < set->count; p++) {
+        const Bit_Pattern *pattern = set->patterns[p];
+        uint64_t keys[k + 1];
+        if (pattern->len / (k + 1) < SEED_MIN_LEN || seed_pieces(pattern->needle, pattern->len, seed_len, keys, k + 1) <= k) {
+            index->always[p] = 1;
+            continue;
+        }
+        for (size_t piece = 0; piece <= k; piece++) {
+            size_t h = seed_hash(keys[piece], index->capacity);
+            while (index->items[h].occupied) h = (h + 1) & (index->capacity - 1);
+            index->items[h] = (Seed_Entry){ .key = keys[piece], .pattern = (uint32_t)p, .occupied = true };
+        }
+        indexed++;
+    }
+    if (indexed == 0) {
+        free(index->items);
+        free(index->always);
+        memset(index, 0, sizeof(*index));
+        return true;
+    }
+    index->enabled = true;
+    return true;
+}
+
+// Marks in candidates the patterns that have at least one seed in the haystack.
+void seed_index_candidates(const Seed_Index *index, size_t n_patterns, const Packed_Seq *haystack, uint8_t *candidates)
+{
+    memcpy(candidates, index->always, n_patterns);
+    uint64_t mask = index->seed_len == 32 ? ~(uint64_t)0 : ((uint64_t)1 << (2 * index->seed_len)) - 1;
+    uint64_t key = 0;
+    size_t valid = 0;
+
+    for (size_t j = 0; j < haystack->len; j++) {
+        if (packed_seq_is_n(haystack, j)) {
+            valid = 0;
+            continue;
+        }
+        key = ((key << 2) | (uint64_t)packed_seq_code(haystack, j)) & mask;
+        if (++valid < index->seed_len) continue;
+
+        size_t h = seed_hash(key, index->capacity);
+        while (index->items[h].occupied) {
+            if (index->items[h].key == key) candidates[index->items[h].pattern] = 1;
+            h = (h + 1) & (index->capacity - 1);
+        }
+    }
+}
+
+static inline size_t neighbour_hash(uint64_t key, size_t len, size_t capacity)
+{
+    return seed_hash(key ^ ((uint64_t)len * 0x9e3779b97f4a7c15ULL), capacity);
+}
+
+static bool neighbourhood_insert(Neighbourhood *nb, uint64_t key, size_t len, uint32_t pattern, size_t dist)
+{
+    if (2 * (nb->count + 1) > nb->capacity) {
+        size_t new_capacity = nb->capacity ? nb->capacity * 2 : 1024;
+        Neighbour_Entry *new_items = calloc(new_capacity, sizeof(Neighbour_Entry));
+        if (!new_items) return false;
+        for (size_t i = 0; i < nb->capacity; i++) {
+            Neighbour_Entry *e = &nb->items[i];
+            if (!e->occupied) continue;
+            size_t h = neighbour_hash(e->key, e->len, new_capacity);
+            while (new_items[h].occupied) h = (h + 1) & (new_capacity - 1);
+            new_items[h] = *e;
+        }
+        free(nb->items);
+        nb->items = new_items;
+        nb->capacity = new_capacity;
+    }
+
+    size_t h = neighbour_hash(key, len, nb->capacity);
+    while (nb->items[h].occupied) {
+        Neighbour_Entry *e = &nb->items[h];
+        if (e->key == key && e->len == len && e->pattern == pattern) {
+            if (dist < e->dist) e->dist = (uint8_t)dist;
+            return true;
+        }
+        h = (h + 1) & (nb->capacity - 1);
+    }
+    nb->items[h] = (Neighbour_Entry){ .key = key, .pattern = pattern, .len = (uint8_t)len, .dist = (uint8_t)dist, .occupied = true };
+    nb->count++;
+    nb->lengths |= (uint64_t)1 << len;
+    return true;
+}
+
+// Enumerates all sequences reachable from buf with at most edits_left
+// substitutions, insertions and deletions. A sequence reached along several
+// paths keeps the shortest, i.e. its edit distance to the pattern. Fails once
+// the table outgrows max_entries.
+static bool neighbourhood_expand(Neighbourhood *nb, uint32_t pattern, char *buf, size_t len, size_t edits_left, size_t max_entries)
+{
+    static const char bases[4] = { 'A', 'C', 'G', 'T' };
+
+    if (len > 0) {
+        uint64_t key;
+        if (!seed_pack(buf, len, &key)) return false;
+        if (!neighbourhood_insert(nb, key, len, pattern, nb->k - edits_left)) return false;
+        if (nb->count > max_entries) return false;
+    }
+    if (edits_left == 0) return true;
+
+    for (size_t i = 0; i < len; i++) {
+        char orig = buf[i];
+        for (size_t b = 0; b < 4; b++) {
+            if (bases[b] == orig) continue;
+            buf[i] = bases[b];
+            if (!neighbourhood_expand(nb, pattern, buf, len, edits_left - 1, max_entries)) return false;
+        }
+        buf[i] = orig;
+    }
+    for (size_t i = 0; i < len; i++) {
+        char removed = buf[i];
+        memmove(buf + i, buf + i + 1, len - i - 1);
+        bool ok = neighbourhood_expand(nb, pattern, buf, len - 1, edits_left - 1, max_entries);
+        memmove(buf + i + 1, buf + i, len - i - 1);
+        buf[i] = removed;
+        if (!ok) return false;
+    }
+    if (len < NEIGHBOURHOOD_MAX_LEN) {
+        for (size_t i = 0; i <= len; i++) {
+            memmove(buf + i + 1, buf + i, len - i);
+            bool ok = true;
+            for (size_t b = 0; b < 4 && ok; b++) {
+                buf[i] = bases[b];
+                ok = neighbourhood_expand(nb, pattern, buf, len + 1, edits_left - 1, max_entries);
+            }
+            memmove(buf + i, buf + i + 1, len - i);
+            if (!ok) return false;
+        }
+    }
+    return true;
+}
+
+// Expands the degenerate bases of buf from position i on into each base they
+// stand for, then enumerates the edits of every plain sequence. Its distance to
+// the pattern is the lowest over these.
+static bool neighbourhood_expand_degenerate(Neighbourhood *nb, uint32_t pattern, char *buf, size_t len, size_t i, size_t max_entries)
+{
+    while (i < len && nt_is_base(buf[i])) i++;
+    if (i == len) return neighbourhood_expand(nb, pattern, buf, len, nb->k, max_entries);
+
+    unsigned mask = nt_iupac_mask(buf[i]);
+    char orig = buf[i];
+    for (int code = 0; code < 4; code++) {
+        if (!(mask & (1u << code))) continue;
+        buf[i] = "ACTG"[code];
+        if (!neighbourhood_expand_degenerate(nb, pattern, buf, len, i + 1, max_entries)) return false;
+    }
+    buf[i] = orig;
+    return true;
+}
+
+static void neighbourhood_free(Neighbourhood *nb)
+{
+    free(nb->items);
+    free(nb->always);
+    memset(nb, 0, sizeof(*nb));
+}
+
+// Builds the neighbourhood table for k. Leaves it disabled (and returns true)
+// when k is too large or the table would exceed max_entries, in which case the
+// seed filter and the aligner are used instead.
+bool pattern_set_build_neighbourhood(Pattern_Set *set, size_t k, size_t max_entries)
+{
+    Neighbourhood *nb = &set->neighbours;
+    neighbourhood_free(nb);
+    nb->k = k;
+    if (set->count == 0 || k > NEIGHBOURHOOD_MAX_K) return true;
+
+    nb->always = calloc(set->count, sizeof(uint8_t));
+    if (!nb->always) return false;
+
+    size_t indexed = 0;
+    for (size_t p = 0; p < set->count; p++) {
+        const Bit_Pattern *pattern = set->patterns[p];
+        char buf[NEIGHBOURHOOD_MAX_LEN + 1];
+        // patterns that are too long, have bytes that aren't IUPAC codes, or
+        // are matched by anything (k >= len) are aligned as usual
+        if (pattern->len <= k || pattern->len + k > NEIGHBOURHOOD_MAX_LEN || nt_first_non_iupac(pattern->needle, pattern->len)) {
+            nb->always[p] = 1;
+            nb->has_always = true;
+            continue;
+        }
+        memcpy(buf, pattern->needle, pattern->len);
+        if (!neighbourhood_expand_degenerate(nb, (uint32_t)p, buf, pattern->len, 0, max_entries)) {
+            neighbourhood_free(nb);
+            nb->k = k;
+            return true;
+        }
+        indexed++;
+    }
+    if (indexed == 0) {
+        neighbourhood_free(nb);
+        nb->k = k;
+        return true;
+    }
+    nb->enabled = true;
+    return true;
+}
+
+// Classifies the haystack by looking up every window whose length occurs in
+// the table. Returns false when the haystack has masked bases, which the table
+// can't represent; the caller must then align instead. Patterns
+// flagged in always are left at -1.
+bool neighbourhood_search(const Neighbourhood *nb, const Pattern_Set *set, const Packed_Seq *haystack, int *ends, int *dists)
+{
+    if (packed_seq_has_n(haystack)) return false;
+    for (size_t p = 0; p < set->count; p++) {
+        ends[p] = -1;
+        dists[p] = -1;
+    }
+
+    uint64_t window = 0;
+    for (size_t j = 0; j < haystack->len; j++) {
+        window = (window << 2) | (uint64_t)packed_seq_code(haystack, j);
+        size_t end = j + 1;
+
+        uint64_t lengths = nb->lengths;
+        while (lengths) {
+            size_t len = (size_t)__builtin_ctzll(lengths);
+            lengths &= lengths - 1;
+            if (len > end) break;
+
+            uint64_t key = len == 32 ? window : window & (((uint64_t)1 << (2 * len)) - 1);
+            size_t h = neighbour_hash(key, len, nb->capacity);
+            while (nb->items[h].occupied) {
+                const Neighbour_Entry *e = &nb->items[h];
+                if (e->key == key && e->len == len && end >= set->patterns[e->pattern]->len &&
+                    (dists[e->pattern] == -1 || e->dist < dists[e->pattern])) {
+                    ends[e->pattern] = (int)end;
+                    dists[e->pattern] = e->dist;
+                }
+                h = (h + 1) & (nb->capacity - 1);
+            }
+        }
+    }
+    return true;
+}
+
+bool pattern_set_init(Pattern_Set *set, const Bit_Pattern **patterns, size_t count)
+{
+    memset(set, 0, sizeof(*set));
+    set->patterns = patterns;
+    set->count = count;
+    set->n_groups = (count + PATTERN_LANES - 1) / PATTERN_LANES;
+    set->level = simd_level_detect();
+
+    size_t lanes = set->n_groups * PATTERN_LANES;
+    set->peq = calloc(lanes * PATTERN_ROWS, sizeof(uint64_t));
+    set->high_bits = calloc(lanes, sizeof(uint64_t));
+    set->lens = calloc(lanes, sizeof(uint64_t));
+    if (!set->peq || !set->high_bits || !set->lens) {
+        pattern_set_free(set);
+        return false;
+    }
+
+    for (size_t p = 0; p < count; p++) {
+        const Bit_Pattern *pattern = patterns[p];
+        size_t group = p / PATTERN_LANES;
+        size_t lane = p % PATTERN_LANES;
+        // empty and long patterns are left to the scalar matcher
+        if (pattern->len == 0 || pattern->len > BIT_PATTERN_MAX) continue;
+        set->high_bits[p] = (uint64_t)1 << (pattern->len - 1);
+        set->lens[p] = pattern->len;
+        for (size_t code = 0; code < 4; code++) {
+            set->peq[(group * PATTERN_ROWS + code) * PATTERN_LANES + lane] = pattern->peq[(unsigned char)"ACTG"[code]];
+        }
+    }
+    return true;
+}
+
+void pattern_set_free(Pattern_Set *set)
+{
+    neighbourhood_free(&set->neighbours);
+    free(set->seeds.items);
+    free(set->seeds.always);
+    memset(&set->seeds, 0, sizeof(set->seeds));
+    free(set->peq);
+    free(set->high_bits);
+    free(set->lens);
+    set->peq = NULL;
+    set->high_bits = NULL;
+    set->lens = NULL;
+}
+
+// Lanes that need no vector work: padding, patterns the vector kernels can't
+// hold, patterns ruled out by the seed filter, and patterns that can never
+// match because k exceeds their length. Every pattern of the group starts out
+// without a hit.
+static inline int pattern_group_done_mask(const Pattern_Set *set, size_t group, size_t k, const uint8_t *candidates, int *ends, int *dists)
+{
+    int done = 0;
+    for (size_t lane = 0; lane < PATTERN_LANES; lane++) {
+        size_t p = group * PATTERN_LANES + lane;
+        if (p < set->count) {
+            ends[p] = -1;
+            dists[p] = -1;
+        }
+        if (p >= set->count || set->high_bits[p] == 0 || k > set->lens[p] || (candidates && !candidates[p])) {
+            done |= 1 << lane;
+        }
+    }
+    return done;
+}
+
+// Records a new best hit for the lanes in bits. Returns the lanes that found
+// an exact match and can't improve any further.
+static inline int pattern_group_record(int bits, size_t group, size_t end, const uint64_t *scores, uint64_t *best, int *ends, int *dists)
+{
+    int exact = 0;
+    for (size_t lane = 0; lane < PATTERN_LANES; lane++) {
+        if (!(bits & (1 << lane))) continue;
+        best[lane] = scores[lane];
+        ends[group * PATTERN_LANES + lane] = (int)end;
+        dists[group * PATTERN_LANES + lane] = (int)scores[lane];
+        if (scores[lane] == 0) exact |= 1 << lane;
+    }
+    return exact;
+}
+
+#ifdef COMMON_X86_SIMD
+// Same recurrence as bit_parallel_best, with one pattern per 64-bit lane.
+// best holds each lane's lowest score so far (k + 1 before the first hit).
+__attribute__((target("avx2")))
+static void pattern_set_search_avx2(const Pattern_Set *set, const Packed_Seq *haystack, size_t k, const uint8_t *candidates, int *ends, int *dists)
+{
+    const __m256i ones = _mm256_set1_epi64x(-1);
+
+    for (size_t g = 0; g < set->n_groups; g++) {
+        int done = pattern_group_done_mask(set, g, k, candidates, ends, dists);
+        if (done == 0xF) continue;
+
+        const uint64_t *peq = set->peq + g * PATTERN_ROWS * PATTERN_LANES;
+        __m256i hb = _mm256_loadu_si256((const __m256i *)(set->high_bits + g * PATTERN_LANES));
+        __m256i lens = _mm256_loadu_si256((const __m256i *)(set->lens + g * PATTERN_LANES));
+        __m256i min_end = _mm256_sub_epi64(lens, _mm256_set1_epi64x(1));
+        __m256i pv = ones;
+        __m256i mv = _mm256_setzero_si256();
+        __m256i score = lens;
+        uint64_t best_lanes[PATTERN_LANES] = { k + 1, k + 1, k + 1, k + 1 };
+        __m256i best = _mm256_set1_epi64x((long long)(k + 1));
+
+        for (size_t j = 0; j < haystack->len && done != 0xF; j++) {
+            __m256i eq = _mm256_loadu_si256((const __m256i *)(peq + packed_seq_row(haystack, j) * PATTERN_LANES));
+            __m256i xv = _mm256_or_si256(eq, mv);
+            __m256i xh = _mm256_or_si256(_mm256_xor_si256(_mm256_add_epi64(_mm256_and_si256(eq, pv), pv), pv), eq);
+            __m256i ph = _mm256_or_si256(mv, _mm256_andnot_si256(_mm256_or_si256(xh, pv), ones));
+            __m256i mh = _mm256_and_si256(pv, xh);
+
+            score = _mm256_sub_epi64(score, _mm256_cmpeq_epi64(_mm256_and_si256(ph, hb), hb));
+            score = _mm256_add_epi64(score, _mm256_cmpeq_epi64(_mm256_and_si256(mh, hb), hb));
+
+            ph = _mm256_slli_epi64(ph, 1);
+            mh = _mm256_slli_epi64(mh, 1);
+            pv = _mm256_or_si256(mh, _mm256_andnot_si256(_mm256_or_si256(xv, ph), ones));
+            mv = _mm256_and_si256(ph, xv);
+
+            __m256i in_range = _mm256_cmpgt_epi64(_mm256_set1_epi64x((long long)(j + 1)), min_end);
+            __m256i better = _mm256_and_si256(_mm256_cmpgt_epi64(best, score), in_range);
+            int bits = _mm256_movemask_pd(_mm256_castsi256_pd(better)) & ~done;
+            if (bits) {
+                uint64_t scores[PATTERN_LANES];
+                _mm256_storeu_si256((__m256i *)scores, score);
+                done |= pattern_group_record(bits, g, j + 1, scores, best_lanes, ends, dists);
+                best = _mm256_loadu_si256((const __m256i *)best_lanes);
+            }
+        }
+    }
+}
+
+// Two lanes per register. SSE4.1 has no 64-bit signed compare, but scores and
+// positions fit in the low 32 bits of each lane, so a 32-bit compare is enough.
+__attribute__((target("sse4.1")))
+static void pattern_set_search_sse41(const Pattern_Set *set, const Packed_Seq *haystack, size_t k, const uint8_t *candidates, int *ends, int *dists)
+{
+    const __m128i ones = _mm_set1_epi64x(-1);
+
+    for (size_t g = 0; g < set->n_groups; g++) {
+        int done = pattern_group_done_mask(set, g, k, candidates, ends, dists);
+        if (done == 0xF) continue;
+
+        const uint64_t *peq = set->peq + g * PATTERN_ROWS * PATTERN_LANES;
+        uint64_t best_lanes[PATTERN_LANES] = { k + 1, k + 1, k + 1, k + 1 };
+        __m128i hb[2], min_end[2], pv[2], mv[2], score[2], best[2];
+        for (int h = 0; h < 2; h++) {
+            hb[h] = _mm_loadu_si128((const __m128i *)(set->high_bits + g * PATTERN_LANES + 2 * h));
+            score[h] = _mm_loadu_si128((const __m128i *)(set->lens + g * PATTERN_LANES + 2 * h));
+            min_end[h] = _mm_sub_epi64(score[h], _mm_set1_epi64x(1));
+            pv[h] = ones;
+            mv[h] = _mm_setzero_si128();
+            best[h] = _mm_set1_epi64x((long long)(k + 1));
+        }
+
+        for (size_t j = 0; j < haystack->len && done != 0xF; j++) {
+            const uint64_t *eq_row = peq + packed_seq_row(haystack, j) * PATTERN_LANES;
+            __m128i jv = _mm_set1_epi64x((long long)(j + 1));
+            int bits = 0;
+            for (int h = 0; h < 2; h++) {
+                __m128i eq = _mm_loadu_si128((const __m128i *)(eq_row + 2 * h));
+                __m128i xv = _mm_or_si128(eq, mv[h]);
+                __m128i xh = _mm_or_si128(_mm_xor_si128(_mm_add_epi64(_mm_and_si128(eq, pv[h]), pv[h]), pv[h]), eq);
+                __m128i ph = _mm_or_si128(mv[h], _mm_andnot_si128(_mm_or_si128(xh, pv[h]), ones));
+                __m128i mh = _mm_and_si128(pv[h], xh);
+
+                score[h] = _mm_sub_epi64(score[h], _mm_cmpeq_epi64(_mm_and_si128(ph, hb[h]), hb[h]));
+                score[h] = _mm_add_epi64(score[h], _mm_cmpeq_epi64(_mm_and_si128(mh, hb[h]), hb[h]));
+
+                ph = _mm_slli_epi64(ph, 1);
+                mh = _mm_slli_epi64(mh, 1);
+                pv[h] = _mm_or_si128(mh, _mm_andnot_si128(_mm_or_si128(xv, ph), ones));
+                mv[h] = _mm_and_si128(ph, xv);
+
+                __m128i in_range = _mm_cmpgt_epi32(jv, min_end[h]);
+                __m128i better = _mm_and_si128(_mm_cmpgt_epi32(best[h], score[h]), in_range);
+                int mask = _mm_movemask_ps(_mm_castsi128_ps(better));
+                bits |= (((mask >> 0) & 1) | (((mask >> 2) & 1) << 1)) << (2 * h);
+            }
+            bits &= ~done;
+            if (bits) {
+                uint64_t scores[PATTERN_LANES];
+                _mm_storeu_si128((__m128i *)scores, score[0]);
+                _mm_storeu_si128((__m128i *)(scores + 2), score[1]);
+                done |= pattern_group_record(bits, g, j + 1, scores, best_lanes, ends, dists);
+                best[0] = _mm_loadu_si128((const __m128i *)best_lanes);
+                best[1] = _mm_loadu_si128((const __m128i *)(best_lanes + 2));
+            }
+        }
+    }
+}
+#endif // COMMON_X86_SIMD
+
+// Aligns the candidate patterns (all when candidates is NULL) with the best
+// available kernel. Other patterns get -1.
+static void pattern_set_align(const Pattern_Set *set, const Packed_Seq *packed, size_t k, const uint8_t *candidates, int *ends, int *dists)
+{
+    const char *haystack = packed->seq;
+    size_t haystack_len = packed->len;
+    switch (set->level) {
+#ifdef COMMON_X86_SIMD
+        case SIMD_AVX2:
+            pattern_set_search_avx2(set, packed, k, candidates, ends, dists);
+            break;
+        case SIMD_SSE41:
+            pattern_set_search_sse41(set, packed, k, candidates, ends, dists);
+            break;
+#endif
+        default:
+            for (size_t p = 0; p < set->count; p++) {
+                if (candidates && !candidates[p]) ends[p] = dists[p] = -1;
+                else ends[p] = bit_parallel_best(haystack, haystack_len, set->patterns[p], k, &dists[p]);
+            }
+            return;
+    }
+
+    for (size_t p = 0; p < set->count; p++) {
+        size_t len = set->patterns[p]->len;
+        if (len == 0 || len > BIT_PATTERN_MAX) {
+            if (candidates && !candidates[p]) ends[p] = dists[p] = -1;
+            else ends[p] = bit_parallel_best(haystack, haystack_len, set->patterns[p], k, &dists[p]);
+        }
+    }
+}
+
+// Searches the haystack for every pattern of the set. ends[i] and dists[i]
+// receive the best hit bit_parallel_best would give for patterns[i] in
+// haystack->seq, which the scalar matcher and patterns longer than
+// BIT_PATTERN_MAX still read. The neighbourhood table answers without
+// aligning when it exists for this k; otherwise the seed index, if any,
+// limits alignment to patterns with a seed hit.
+void pattern_set_search(const Pattern_Set *set, const Packed_Seq *haystack, size_t k, int *ends, int *dists)
+{
+    if (set->count == 0) return;
+
+    const Neighbourhood *nb = &set->neighbours;
+    if (nb->enabled && nb->k == k && neighbourhood_search(nb, set, haystack, ends, dists)) {
+        if (!nb->has_always) return;
+        int aligned[set->count];
+        int aligned_dists[set->count];
+        pattern_set_align(set, haystack, k, nb->always, aligned, aligned_dists);
+        for (size_t p = 0; p < set->count; p++) {
+            if (nb->always[p]) {
+                ends[p] = aligned[p];
+                dists[p] = aligned_dists[p];
+            }
+        }
+        return;
+    }
+
+    uint8_t candidate_buf[set->count];
+    const uint8_t *candidates = NULL;
+    if (set->seeds.enabled && set->seeds.k == k) {
+        seed_index_candidates(&set->seeds, set->count, haystack, candidate_buf);
+        candidates = candidate_buf;
+    }
+    pattern_set_align(set, haystack, k, candidates, ends, dists);
+}
+
+static inline int min(int a, int b, int c) 
+{
+    int min = a;
+    if (b < min) {
+        min = b;
+    }
+    if (c < min) {
+        min = c;
+    }
+    return min;
+}
+
+// min for DP cells, which are counts.
+static inline size_t min_size(size_t a, size_t b, size_t c)
+{
+    size_t min = a;
+    if (b < min) min = b;
+    if (c < min) min = c;
+    return min;
+}
+
+int parse_csv_headers(const char *barcode_path) 
+{
+    FILE *f = fopen(barcode_path, "r");
+    if (!f) {
+        printf("Error: couldn't open file\n");
+        return -1;
+    }
+    
+    char cols[10][100];  
+    int count = 0;
+    int c;
+    
+    while (fscanf(f, "%99[^,\n]", cols[count]) == 1) {
+        count++;
+        if (count >= 10) break;
+        c = fgetc(f);
+        if (c == '\n' || c == EOF) break;
+    }
+    
+    fclose(f);
+
+    if (!(count == 2 || count == 3)) {
+        printf("ERROR: Wrong amount of barcode headers\n");
+        print_barcode_documentation();
+        return -1;
+    }
+
+    // single barcode
+    if (count == 2) {
+        if (strcmp(cols[0], "name") != 0 || strcmp(cols[1], "forward") != 0) {
+            printf("ERROR: Headers of barcode file have incorrect headers\n");
+            print_barcode_documentation();
+            return -1;
+        }
+        return 1;
+    // dual barcode
+    } else {
+        if (strcmp(cols[0], "name") != 0 || strcmp(cols[1], "forward") != 0 || strcmp(cols[2], "reverse") != 0) {
+            printf("ERROR: Headers of barcode file have incorrect headers\n");
+            print_barcode_documentation();
+            return -1;
+        }
+       return 2; 
+    }
+    //UNREACHABLE
+}
+
+void slice(const char* src, char* dest, size_t start, size_t end) 
+{
+    size_t length = end - start;
+    memcpy(dest, src + start, length);
+    dest[length] = '\0';  
+}
+
+FILE* open_summary_file(const char *out_folder, const char *filename) 
+{
+    char summary_file[FILE_CAP];
+    snprintf(summary_file, sizeof(summary_file), "%s/%s", out_folder, filename);
+    
+    FILE *S_FILE = fopen(summary_file, "ab");
+    if (S_FILE == NULL) {
+        nob_log(NOB_ERROR, "Could NOT create summary file");
+        return NULL;
+    }
+    
+    return S_FILE;
+}
+
+
+bool batch_queue_init(Batch_Queue *q, size_t capacity)
+{
+    memset(q, 0, sizeof(*q));
+    q->items = malloc(capacity * sizeof(void *));
+    if (!q->items) return false;
+    q->capacity = capacity;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return true;
+}
+
+void batch_queue_destroy(Batch_Queue *q)
+{
+    free(q->items);
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+}
+
+void batch_queue_push(Batch_Queue *q, void *item)
+{
+    pthread_mutex_lock(&q->mutex);
+    while (q->count == q->capacity) pthread_cond_wait(&q->not_full, &q->mutex);
+    q->items[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+void *batch_queue_pop(Batch_Queue *q)
+{
+    pthread_mutex_lock(&q->mutex);
+    while (q->count == 0 && !q->closed) pthread_cond_wait(&q->not_empty, &q->mutex);
+    void *item = NULL;
+    if (q->count > 0) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return item;
+}
+
+void batch_queue_close(Batch_Queue *q)
+{
+    pthread_mutex_lock(&q->mutex);
+    q->closed = true;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+void latch_init(Latch *latch)
+{
+    latch->pending = 0;
+    pthread_mutex_init(&latch->mutex, NULL);
+    pthread_cond_init(&latch->done, NULL);
+}
+
+void latch_destroy(Latch *latch)
+{
+    pthread_mutex_destroy(&latch->mutex);
+    pthread_cond_destroy(&latch->done);
+}
+
+void latch_add(Latch *latch, size_t n)
+{
+    pthread_mutex_lock(&latch->mutex);
+    latch->pending += n;
+    pthread_mutex_unlock(&latch->mutex);
+}
+
+void latch_done(Latch *latch)
+{
+    pthread_mutex_lock(&latch->mutex);
+    if (--latch->pending == 0) pthread_cond_broadcast(&latch->done);
+    pthread_mutex_unlock(&latch->mutex);
+}
+
+void latch_wait(Latch *latch)
+{
+    pthread_mutex_lock(&latch->mutex);
+    while (latch->pending > 0) pthread_cond_wait(&latch->done, &latch->mutex);
+    pthread_mutex_unlock(&latch->mutex);
+}
+
+#define ARENA_INIT_CAP (16 * 1024 * 1024)
+
+// Moves pointers into the old arena to the new one. Reads that are views into
+// a mapped file keep their pointers.
+static inline const char *rebase_ptr(const char *p, const char *old_base, size_t old_count, char *new_base)
+{
+    return p && p >= old_base && p < old_base + old_count ? new_base + (p - old_base) : p;
+}
+
+static bool read_batch_reserve(Read_Batch *batch, size_t extra)
+{
+    Arena *arena = &batch->arena;
+    if (arena->count + extra <= arena->capacity) return true;
+
+    size_t new_capacity = arena->capacity ? arena->capacity : ARENA_INIT_CAP;
+    while (new_capacity < arena->count + extra) new_capacity *= 2;
+    char *new_items = malloc(new_capacity);
+    if (!new_items) return false;
+    if (arena->count) memcpy(new_items, arena->items, arena->count);
+
+    for (size_t i = 0; i < batch->reads.count; i++) {
+        Read *read = &batch->reads.items[i];
+        read->seq = rebase_ptr(read->seq, arena->items, arena->count, new_items);
+        read->name = rebase_ptr(read->name, arena->items, arena->count, new_items);
+        read->comment = rebase_ptr(read->comment, arena->items, arena->count, new_items);
+        read->qual = rebase_ptr(read->qual, arena->items, arena->count, new_items);
+        read->first_slice = rebase_ptr(read->first_slice, arena->items, arena->count, new_items);
+        read->last_slice = rebase_ptr(read->last_slice, arena->items, arena->count, new_items);
+    }
+    free(arena->items);
+    arena->items = new_items;
+    arena->capacity = new_capacity;
+    return true;
+}
+
+// Copies one record into the batch arena. Returns the new read, whose pointers
+// stay valid until the arena grows again or the batch is reset. A NULL
+// comment is not copied.
+Read *read_batch_push(Read_Batch *batch, const char *name, size_t name_len, const char *comment, size_t comment_len, const char *seq, const char *qual, size_t len)
+{
+    if (!comment) comment_len = 0;
+    if (!read_batch_reserve(batch, name_len + comment_len + 2 * len + 4)) return NULL;
+
+    Arena *arena = &batch->arena;
+    char *p = arena->items + arena->count;
+    Read read = {0};
+
+    read.name = p;
+    memcpy(p, name, name_len);
+    p[name_len] = '\0';
+    p += name_len + 1;
+
+    if (comment) {
+        read.comment = p;
+        memcpy(p, comment, comment_len);
+        p[comment_len] = '\0';
+        p += comment_len + 1;
+    }
+
+    read.seq = p;
+    memcpy(p, seq, len);
+    p[len] = '\0';
+    p += len + 1;
+
+    read.qual = p;
+    memcpy(p, qual, len);
+    p[len] = '\0';
+    p += len + 1;
+
+    read.name_len = name_len;
+    read.comment_len = comment_len;
+    read.len = len;
+    arena->count = p - arena->items;
+    nob_da_append(&batch->reads, read);
+    return &batch->reads.items[batch->reads.count - 1];
+}
+
+void read_batch_reset(Read_Batch *batch)
+{
+    batch->reads.count = 0;
+    batch->arena.count = 0;
+}
+
+void read_batch_free(Read_Batch *batch)
+{
+    nob_da_free(batch->reads);
+    free(batch->arena.items);
+    memset(batch, 0, sizeof(*batch));
+}
+
+// ---- mapped FASTQ ----
+
+bool is_gzip_file(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return false;
+    unsigned char magic[2] = {0};
+    size_t n = fread(magic, 1, 2, fp);
+    fclose(fp);
+    return n == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+bool mapped_file_open(Mapped_File *mf, const char *path)
+{
+    memset(mf, 0, sizeof(*mf));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return false;
+    }
+    if (st.st_size > 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        mf->data = data;
+        mf->size = st.st_size;
+    }
+    close(fd);
+    return true;
+}
+
+void mapped_file_close(Mapped_File *mf)
+{
+    if (mf->data) munmap(mf->data, mf->size);
+    memset(mf, 0, sizeof(*mf));
+}
+
+// End of the line starting at p, without a trailing '\r'. *next is set to the
+// start of the following line, or end.
+static const char *fastq_line(const char *p, const char *end, const char **next)
+{
+    const char *nl = memchr(p, '\n', end - p);
+    *next = nl ? nl + 1 : end;
+    if (!nl) nl = end;
+    if (nl > p && nl[-1] == '\r') nl--;
+    return nl;
+}
+
+// Parses the four-line record at *pos into a view: name, comment, seq and qual
+// point into the buffer and are not NUL-terminated. The name stops at the
+// first blank like kseq's, and the comment is the rest of the header after
+// the blanks. Returns 1 for a record, 0 at the end of the buffer and
+// -1 for anything that isn't a four-line record, such as wrapped sequences.
+int fastq_next_record(const char **pos, const char *end, Read *read)
+{
+    const char *p = *pos;
+    while (p < end && (*p == '\n' || *p == '\r')) p++;
+    if (p == end) {
+        *pos = end;
+        return 0;
+    }
+    if (*p != '@') return -1;
+
+    const char *next;
+    const char *header_end = fastq_line(p, end, &next);
+    const char *seq = next;
+    const char *seq_end = fastq_line(seq, end, &next);
+    if (next == end || *next != '+') return -1;
+    fastq_line(next, end, &next);
+    const char *qual = next;
+    const char *qual_end = fastq_line(qual, end, &next);
+    if (qual_end - qual != seq_end - seq) return -1;
+
+    const char *name = p + 1;
+    const char *name_end = name;
+    while (name_end < header_end && *name_end != ' ' && *name_end != '\t') name_end++;
+    const char *comment = name_end;
+    while (comment < header_end && (*comment == ' ' || *comment == '\t')) comment++;
+
+    memset(read, 0, sizeof(*read));
+    read->name = name;
+    read->name_len = name_end - name;
+    read->comment = comment;
+    read->comment_len = header_end - comment;
+    read->seq = seq;
+    read->qual = qual;
+    read->len = seq_end - seq;
+    *pos = next;
+    return 1;
+}
+
+// True when p starts a record: an '@' line whose third line starts with '+'.
+// A quality line starting with '@' is followed by a header and a sequence, so
+// it fails the check.
+static bool fastq_record_starts_at(const char *p, const char *end)
+{
+    if (p == end || *p != '@') return false;
+    const char *next;
+    fastq_line(p, end, &next);
+    fastq_line(next, end, &next);
+    return next < end && *next == '+';
+}
+
+// Cuts [0, size) into at most n ranges of whole records so that threads can
+// parse them independently. Writes the range boundaries to bounds[0..m] and
+// returns the number of ranges m.
+size_t fastq_split_ranges(const char *data, size_t size, size_t n, size_t *bounds)
+{
+    size_t m = 0;
+    bounds[0] = 0;
+    for (size_t i = 1; i < n; i++) {
+        size_t target = size / n * i;
+        if (target <= bounds[m]) continue;
+        const char *p = data + target;
+        const char *end = data + size;
+        // move to the start of the next line, then to the next record
+        const char *nl = memchr(p - 1, '\n', end - (p - 1));
+        p = nl ? nl + 1 : end;
+        while (p < end && !fastq_record_starts_at(p, end)) {
+            nl = memchr(p, '\n', end - p);
+            p = nl ? nl + 1 : end;
+        }
+        if (p == end) break;
+        bounds[++m] = p - data;
+    }
+    if (bounds[m] < size || m == 0) bounds[++m] = size;
+    return m;
+}
+
+// ---- header tags ----
+
+static inline bool tag_separator(char c)
+{
+    return c == '=' || c == ':';
+}
+
+// Finds the blank-separated field of a FASTQ comment that starts with key,
+// such as barcode= or BC:Z:, and returns the rest of it, or NULL when no field
+// does. A key without its trailing '=' or ':', such as barcode, takes the one
+// the field has.
+const char *header_tag(const char *comment, size_t comment_len, const char *key, size_t key_len, size_t *value_len)
+{
+    const char *p = comment;
+    const char *end = comment + comment_len;
+    bool has_separator = key_len > 0 && tag_separator(key[key_len - 1]);
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+        const char *field = p;
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\r') p++;
+        size_t prefix = key_len + (has_separator ? 0 : 1);
+        if ((size_t)(p - field) < prefix || memcmp(field, key, key_len) != 0) continue;
+        if (!has_separator && !tag_separator(field[key_len])) continue;
+        *value_len = p - field - prefix;
+        return field + prefix;
+    }
+    return NULL;
+}
+
+static inline size_t tag_hash(const char *value, size_t len, size_t capacity)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)value[i]) * 0x100000001b3ULL;
+    return seed_hash(h, capacity);
+}
+
+bool tag_table_init(Tag_Table *table, const Barcodes *barcodes)
+{
+    size_t capacity = 16;
+    while (capacity < 2 * barcodes->count) capacity *= 2;
+    table->items = calloc(capacity, sizeof(Tag_Entry));
+    table->capacity = capacity;
+    if (!table->items) return false;
+
+    for (size_t i = 0; i < barcodes->count; i++) {
+        const char *name = barcodes->items[i].name;
+        size_t len = strlen(name);
+        size_t h = tag_hash(name, len, capacity);
+        while (table->items[h].occupied) {
+            Tag_Entry *e = &table->items[h];
+            if (e->len == len && memcmp(e->value, name, len) == 0) break;
+            h = (h + 1) & (capacity - 1);
+        }
+        Tag_Entry *e = &table->items[h];
+        if (e->occupied) {
+            e->barcode = TAG_SHARED;
+        } else {
+            *e = (Tag_Entry){ .value = name, .len = len, .barcode = (int)i, .occupied = true };
+        }
+    }
+    return true;
+}
+
+// Returns the barcode row named value, TAG_SHARED for a name used by several
+// rows, or -1.
+int tag_table_lookup(const Tag_Table *table, const char *value, size_t len)
+{
+    size_t h = tag_hash(value, len, table->capacity);
+    while (table->items[h].occupied) {
+        const Tag_Entry *e = &table->items[h];
+        if (e->len == len && memcmp(e->value, value, len) == 0) return e->barcode;
+        h = (h + 1) & (table->capacity - 1);
+    }
+    return -1;
+}
+
+void tag_table_free(Tag_Table *table)
+{
+    free(table->items);
+    table->items = NULL;
+    table->capacity = 0;
+}
+
+// ---- parallel gzip input ----
+
+static bool gz_header_at(const uint8_t *data, size_t size, size_t offset)
+{
+    return offset + 10 <= size && data[offset] == 0x1f && data[offset + 1] == 0x8b &&
+           data[offset + 2] == 8 && (data[offset + 3] & 0xe0) == 0;
+}
+
+// Gzip timestamps before 1990 don't occur in sequencing data; 0 means none.
+#define GZ_MTIME_MIN 631152000u
+
+// Stricter than gz_header_at, for offsets found by scanning deflate data,
+// where the four magic bytes turn up by chance: the MTIME, XFL and OS fields
+// must hold values gzip writers use (MTIME has no upper bound, so the answer
+// doesn't depend on the clock), the FEXTRA subfields must add up to
+// XLEN, FNAME and FCOMMENT must end, and FHCRC must match.
+static bool gz_header_plausible(const uint8_t *data, size_t size, size_t offset)
+{
+    if (!gz_header_at(data, size, offset)) return false;
+    const uint8_t *h = data + offset;
+    uint8_t flags = h[3];
+    uint32_t mtime = h[4] | (h[5] << 8) | (h[6] << 16) | ((uint32_t)h[7] << 24);
+    if (mtime != 0 && mtime < GZ_MTIME_MIN) return false;
+    if (h[8] != 0 && h[8] != 2 && h[8] != 4) return false;
+    if (h[9] > 13 && h[9] != 255) return false;
+
+    size_t p = offset + 10;
+    if (flags & 4) {
+        if (p + 2 > size) return false;
+        size_t xlen = data[p] | (data[p + 1] << 8);
+        p += 2;
+        if (p + xlen > size) return false;
+        size_t q = p;
+        while (q + 4 <= p + xlen) q += 4 + (data[q + 2] | (data[q + 3] << 8));
+        if (q != p + xlen) return false;
+        p += xlen;
+    }
+    for (uint8_t field = 8; field <= 16; field <<= 1) {
+        if (!(flags & field)) continue;
+        const uint8_t *nul = memchr(data + p, 0, size - p);
+        if (!nul) return false;
+        p = nul - data + 1;
+    }
+    if (flags & 2) {
+        if (p + 2 > size) return false;
+        uLong crc = crc32(0, h, (uInt)(p - offset));
+        if ((crc & 0xffff) != (uLong)(data[p] | (data[p + 1] << 8))) return false;
+    }
+    return true;
+}
+
+// Size of the BGZF block at offset, or 0 when the member there has no BC field.
+static size_t bgzf_block_size_at(const uint8_t *data, size_t size, size_t offset)
+{
+    if (!gz_header_at(data, size, offset) || !(data[offset + 3] & 4) || offset + 18 > size) return 0;
+    const uint8_t *h = data + offset;
+    if (h[10] != 6 || h[11] != 0 || h[12] != 'B' || h[13] != 'C' || h[14] != 2 || h[15] != 0) return 0;
+    return (size_t)(h[16] | (h[17] << 8)) + 1;
+}
+
+// Offset of the next possible member after the one at offset: exact for BGZF
+// blocks, otherwise the next plausible gzip header.
+static size_t gz_next_candidate(const uint8_t *data, size_t size, size_t offset)
+{
+    size_t block = bgzf_block_size_at(data, size, offset);
+    if (block) return offset + block;
+    for (size_t i = offset + 1; i < size; i++) {
+        const uint8_t *p = memchr(data + i, 0x1f, size - i);
+        if (!p) break;
+        i = p - data;
+        if (gz_header_plausible(data, size, i)) return i;
+    }
+    return size;
+}
+
+static void gz_member_job(void *arg)
+{
+    Gz_Member *m = (Gz_Member *)arg;
+    z_stream zs = {0};
+    m->status = GZ_MEMBER_FAILED;
+    m->out_len = 0;
+    if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+        latch_done(&m->latch);
+        return;
+    }
+    size_t avail = m->size - m->offset;
+    zs.next_in = (Bytef *)(m->data + m->offset);
+    zs.avail_in = avail > UINT_MAX ? UINT_MAX : (uInt)avail;
+    for (;;) {
+        if (m->out_len == m->out_cap) {
+            if (m->out_cap >= GZ_MEMBER_MAX) {
+                m->status = GZ_MEMBER_TOO_BIG;
+                break;
+            }
+            size_t cap = m->out_cap ? m->out_cap * 2 : BGZF_MAX_BLOCK_SIZE;
+            uint8_t *out = realloc(m->out, cap);
+            if (!out) break;
+            m->out = out;
+            m->out_cap = cap;
+        }
+        zs.next_out = m->out + m->out_len;
+        zs.avail_out = (uInt)(m->out_cap - m->out_len);
+        int ret = inflate(&zs, Z_NO_FLUSH);
+        m->out_len = m->out_cap - zs.avail_out;
+        if (ret == Z_STREAM_END) {
+            m->end = m->offset + zs.total_in;
+            m->status = GZ_MEMBER_OK;
+            break;
+        }
+        if (ret != Z_OK && !(ret == Z_BUF_ERROR && zs.avail_out == 0)) break;
+    }
+    inflateEnd(&zs);
+    latch_done(&m->latch);
+}
+
+// Submits jobs for the next candidates until GZ_IN_FLIGHT are outstanding.
+static void gz_reader_fill(Gz_Reader *r)
+{
+    const uint8_t *data = (const uint8_t *)r->map.data;
+    while (r->pending < GZ_IN_FLIGHT && r->next_candidate < r->map.size) {
+        Gz_Member *m = &r->members[(r->head + r->pending) % GZ_IN_FLIGHT];
+        m->data = data;
+        m->size = r->map.size;
+        m->offset = r->next_candidate;
+        latch_add(&m->latch, 1);
+        r->pending++;
+        thpool_add_work(r->pool, gz_member_job, m);
+        r->next_candidate = gz_next_candidate(data, r->map.size, m->offset);
+    }
+}
+
+static void gz_reader_pop(Gz_Reader *r)
+{
+    latch_wait(&r->members[r->head].latch);
+    r->head = (r->head + 1) % GZ_IN_FLIGHT;
+    r->pending--;
+}
+
+// Inflates the member at pos on this thread, a chunk at a time.
+static bool gz_reader_stream(Gz_Reader *r)
+{
+    const uint8_t *data = (const uint8_t *)r->map.data;
+    if (!r->streaming) {
+        memset(&r->stream, 0, sizeof(r->stream));
+        if (inflateInit2(&r->stream, 15 + 16) != Z_OK) return false;
+        size_t avail = r->map.size - r->pos;
+        r->stream.next_in = (Bytef *)(data + r->pos);
+        r->stream.avail_in = avail > UINT_MAX ? UINT_MAX : (uInt)avail;
+        r->streaming = true;
+    }
+    for (;;) {
+        r->stream.next_out = r->stream_buf;
+        r->stream.avail_out = GZ_STREAM_CHUNK;
+        int ret = inflate(&r->stream, Z_NO_FLUSH);
+        size_t produced = GZ_STREAM_CHUNK - r->stream.avail_out;
+        if (ret == Z_STREAM_END) {
+            r->pos += r->stream.total_in;
+            inflateEnd(&r->stream);
+            r->streaming = false;
+        } else if (ret != Z_OK) {
+            nob_log(NOB_ERROR, "Corrupt gzip data at byte %zu", r->pos);
+            inflateEnd(&r->stream);
+            r->streaming = false;
+            r->failed = true;
+            return false;
+        }
+        if (produced > 0 || !r->streaming) {
+            r->out = r->stream_buf;
+            r->out_len = produced;
+            return true;
+        }
+    }
+}
+
+// Makes the next bytes of the stream available in out. Returns false at the
+// end of the input or on error.
+static bool gz_reader_refill(Gz_Reader *r)
+{
+    const uint8_t *data = (const uint8_t *)r->map.data;
+    if (r->consuming) {
+        gz_reader_pop(r);
+        r->consuming = false;
+    }
+    while (!r->failed) {
+        if (r->streaming) {
+            if (!gz_reader_stream(r)) return false;
+            if (r->out_len > 0) return true;
+            continue;
+        }
+        // like gzread, anything after the last member that isn't a header ends the stream
+        if (!gz_header_at(data, r->map.size, r->pos)) return false;
+        // a header right after the end of a member: the file is multi-member
+        if (r->pos > 0) r->parallel = true;
+        if (!r->parallel) {
+            if (!gz_reader_stream(r)) return false;
+            if (r->out_len > 0) return true;
+            continue;
+        }
+
+        while (r->pending > 0 && r->members[r->head].offset < r->pos) gz_reader_pop(r);
+        if (r->next_candidate < r->pos) r->next_candidate = r->pos;
+        gz_reader_fill(r);
+
+        Gz_Member *m = r->pending > 0 ? &r->members[r->head] : NULL;
+        if (m && m->offset == r->pos) {
+            latch_wait(&m->latch);
+            if (m->status == GZ_MEMBER_OK) {
+                r->pos = m->end;
+                if (m->out_len == 0) {
+                    gz_reader_pop(r);
+                    continue;
+                }
+                r->out = m->out;
+                r->out_len = m->out_len;
+                r->consuming = true;
+                return true;
+            }
+            gz_reader_pop(r);
+        }
+        if (!gz_reader_stream(r)) return false;
+        if (r->out_len > 0) return true;
+    }
+    return false;
+}
+
+Gz_Reader *gz_reader_open(const char *path, threadpool pool)
+{
+    Gz_Reader *r = calloc(1, sizeof(Gz_Reader));
+    if (!r) return NULL;
+    r->pool = pool;
+
+    if (pool && is_gzip_file(path) && mapped_file_open(&r->map, path)) {
+        r->parallel = bgzf_block_size_at((const uint8_t *)r->map.data, r->map.size, 0) > 0;
+        r->stream_buf = malloc(GZ_STREAM_CHUNK);
+        if (!r->stream_buf) {
+            mapped_file_close(&r->map);
+            free(r);
+            return NULL;
+        }
+        for (size_t i = 0; i < GZ_IN_FLIGHT; i++) latch_init(&r->members[i].latch);
+        return r;
+    }
+
+    r->gz = gzopen(path, "r");
+    if (!r->gz) {
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+int gz_reader_read(Gz_Reader *r, void *buf, int len)
+{
+    if (r->gz) return gzread(r->gz, buf, len);
+
+    uint8_t *dest = (uint8_t *)buf;
+    int copied = 0;
+    while (copied < len) {
+        if (r->out_len == 0 && !gz_reader_refill(r)) break;
+        size_t n = r->out_len < (size_t)(len - copied) ? r->out_len : (size_t)(len - copied);
+        memcpy(dest + copied, r->out, n);
+        r->out += n;
+        r->out_len -= n;
+        copied += n;
+    }
+    if (copied == 0 && r->failed) return -1;
+    return copied;
+}
+
+void gz_reader_close(Gz_Reader *r)
+{
+    if (r->gz) {
+        gzclose(r->gz);
+        free(r);
+        return;
+    }
+    while (r->pending > 0) gz_reader_pop(r);
+    if (r->streaming) inflateEnd(&r->stream);
+    for (size_t i = 0; i < GZ_IN_FLIGHT; i++) {
+        free(r->members[i].out);
+        latch_destroy(&r->members[i].latch);
+    }
+    free(r->stream_buf);
+    mapped_file_close(&r->map);
+    free(r);
+}
+
+// ---- BGZF ----
+
+static const uint8_t bgzf_eof_block[28] = {
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+    0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+static void bgzf_put_u32(uint8_t *dest, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) dest[i] = (uint8_t)(value >> (8*i));
+}
+
+static bool bgzf_put_u64(FILE *fp, uint64_t value)
+{
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; i++) bytes[i] = (uint8_t)(value >> (8*i));
+    return fwrite(bytes, 1, sizeof(bytes), fp) == sizeof(bytes);
+}
+
+// A full block of BGZF_BLOCK_SIZE bytes deflates to at most deflateBound() of
+// it, which together with header and footer still fits in BGZF_MAX_BLOCK_SIZE.
+static bool bgzf_compress_block(Bgzf_Block *block)
+{
+    z_stream zs = {0};
+    if (deflateInit2(&zs, block->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+    zs.next_in = block->data;
+    zs.avail_in = (uInt)block->len;
+    zs.next_out = block->out + BGZF_HEADER_SIZE;
+    zs.avail_out = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+    int ret = deflate(&zs, Z_FINISH);
+    size_t deflated = zs.total_out;
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END) return false;
+
+    size_t size = BGZF_HEADER_SIZE + deflated + BGZF_FOOTER_SIZE;
+    memcpy(block->out, bgzf_eof_block, BGZF_HEADER_SIZE);
+    block->out[16] = (uint8_t)((size - 1) & 0xff);
+    block->out[17] = (uint8_t)((size - 1) >> 8);
+    uint8_t *footer = block->out + BGZF_HEADER_SIZE + deflated;
+    bgzf_put_u32(footer, (uint32_t)crc32(crc32(0L, Z_NULL, 0), block->data, (uInt)block->len));
+    bgzf_put_u32(footer + 4, (uint32_t)block->len);
+    block->out_len = size;
+    return true;
+}
+
+static void bgzf_compress_job(void *arg)
+{
+    Bgzf_Block *block = (Bgzf_Block *)arg;
+    block->failed = !bgzf_compress_block(block);
+    latch_done(&block->latch);
+}
+
+// Waits for the oldest outstanding block and appends it to the file.
+static bool bgzf_retire(Bgzf_Writer *w)
+{
+    Bgzf_Block *block = &w->blocks[w->head];
+    latch_wait(&block->latch);
+    w->head = (w->head + 1) % BGZF_IN_FLIGHT;
+    w->pending--;
+
+    if (block->failed) {
+        nob_log(NOB_ERROR, "Failed to compress block of %s", w->path);
+        w->failed = true;
+    }
+    if (w->failed) return false;
+    if (w->write_index && w->compressed_offset > 0) {
+        Bgzf_Index_Entry entry = { w->compressed_offset, w->uncompressed_offset };
+        nob_da_append(&w->index, entry);
+    }
+    if (fwrite(block->out, 1, block->out_len, w->fp) != block->out_len) {
+        nob_log(NOB_ERROR, "Failed to write to %s", w->path);
+        w->failed = true;
+        return false;
+    }
+    w->compressed_offset += block->out_len;
+    w->uncompressed_offset += block->len;
+    block->len = 0;
+    return true;
+}
+
+// Hands the filling block to the pool, retiring the oldest one when all
+// BGZF_IN_FLIGHT slots are taken.
+static bool bgzf_submit(Bgzf_Writer *w)
+{
+    Bgzf_Block *block = &w->blocks[(w->head + w->pending) % BGZF_IN_FLIGHT];
+    block->level = w->level;
+    latch_add(&block->latch, 1);
+    w->pending++;
+    if (w->pool) {
+        thpool_add_work(w->pool, bgzf_compress_job, block);
+    } else {
+        bgzf_compress_job(block);
+    }
+    if (w->pending == BGZF_IN_FLIGHT) return bgzf_retire(w);
+    return true;
+}
+
+Bgzf_Writer *bgzf_open(const char *path, const char *mode, threadpool pool, bool write_index)
+{
+    Bgzf_Writer *w = calloc(1, sizeof(Bgzf_Writer));
+    if (!w) return NULL;
+    w->fp = fopen(path, mode);
+    if (!w->fp) {
+        free(w);
+        return NULL;
+    }
+    w->path = strdup(path);
+    w->pool = pool;
+    w->level = Z_DEFAULT_COMPRESSION;
+    w->write_index = write_index;
+    for (size_t i = 0; i < BGZF_IN_FLIGHT; i++) latch_init(&w->blocks[i].latch);
+
+    // Appending continues the existing members; an index can only describe
+    // the file when this writer produced all of it.
+    if (fseek(w->fp, 0, SEEK_END) == 0) {
+        long size = ftell(w->fp);
+        if (size > 0) w->compressed_offset = (uint64_t)size;
+    }
+    if (w->write_index && w->compressed_offset > 0) {
+        nob_log(NOB_WARNING, "%s already has data, not writing a .gzi index", path);
+        w->write_index = false;
+    }
+    return w;
+}
+
+bool bgzf_write(Bgzf_Writer *w, const void *data, size_t len)
+{
+    const uint8_t *src = (const uint8_t *)data;
+    while (len > 0) {
+        if (w->failed) return false;
+        Bgzf_Block *block = &w->blocks[(w->head + w->pending) % BGZF_IN_FLIGHT];
+        if (!block->data) {
+            block->data = malloc(BGZF_BLOCK_SIZE);
+            block->out = malloc(BGZF_MAX_BLOCK_SIZE);
+            if (!block->data || !block->out) {
+                nob_log(NOB_ERROR, "Failed to allocate compression buffers for %s", w->path);
+                w->failed = true;
+                return false;
+            }
+        }
+        size_t n = BGZF_BLOCK_SIZE - block->len;
+        if (n > len) n = len;
+        memcpy(block->data + block->len, src, n);
+        block->len += n;
+        src += n;
+        len -= n;
+        if (block->len == BGZF_BLOCK_SIZE && !bgzf_submit(w)) return false;
+    }
+    return !w->failed;
+}
+
+static bool bgzf_write_index(Bgzf_Writer *w)
+{
+    char gzi_path[FILE_CAP];
+    snprintf(gzi_path, sizeof(gzi_path), "%s.gzi", w->path);
+    FILE *fp = fopen(gzi_path, "wb");
+    if (!fp) {
+        nob_log(NOB_ERROR, "Could not open %s to write to", gzi_path);
+        return false;
+    }
+    bool ok = bgzf_put_u64(fp, w->index.count);
+    for (size_t i = 0; ok && i < w->index.count; i++) {
+        ok = bgzf_put_u64(fp, w->index.items[i].compressed) &&
+             bgzf_put_u64(fp, w->index.items[i].uncompressed);
+    }
+    if (fclose(fp) != 0) ok = false;
+    if (!ok) nob_log(NOB_ERROR, "Failed to write %s", gzi_path);
+    return ok;
+}
+
+// Compresses the partial block, drains the outstanding ones and terminates the
+// stream with the empty EOF block. Frees the writer even on failure.
+bool bgzf_close(Bgzf_Writer *w)
+{
+    Bgzf_Block *filling = &w->blocks[(w->head + w->pending) % BGZF_IN_FLIGHT];
+    if (filling->len > 0 && !w->failed) bgzf_submit(w);
+    while (w->pending > 0) bgzf_retire(w);
+
+    bool ok = !w->failed;
+    if (ok && fwrite(bgzf_eof_block, 1, sizeof(bgzf_eof_block), w->fp) != sizeof(bgzf_eof_block)) {
+        nob_log(NOB_ERROR, "Failed to write to %s", w->path);
+        ok = false;
+    }
+    if (fclose(w->fp) != 0) ok = false;
+    if (ok && w->write_index) ok = bgzf_write_index(w);
+
+    for (size_t i = 0; i < BGZF_IN_FLIGHT; i++) {
+        free(w->blocks[i].data);
+        free(w->blocks[i].out);
+        latch_destroy(&w->blocks[i].latch);
+    }
+    nob_da_free(w->index);
+    free(w->path);
+    free(w);
+    return ok;
+}
+
+// Serializes one record with plain copies, growing buf once to fit it. A NULL
+// qual writes only the header and sequence lines.
+void fastq_append_record(Nob_String_Builder *buf, const char *name, size_t name_len, const char *seq, const char *qual, size_t len)
+{
+    size_t size = 1 + name_len + 1 + len + 1 + (qual ? 2 + len + 1 : 0);
+    nob_da_reserve(buf, buf->count + size);
+    char *dest = buf->items + buf->count;
+    *dest++ = '@';
+    memcpy(dest, name, name_len);
+    dest += name_len;
+    *dest++ = '\n';
+    memcpy(dest, seq, len);
+    dest += len;
+    *dest++ = '\n';
+    if (qual) {
+        *dest++ = '+';
+        *dest++ = '\n';
+        memcpy(dest, qual, len);
+        dest += len;
+        *dest++ = '\n';
+    }
+    buf->count += size;
 }
 
-bool append_read_to_gzip_fastq(gzFile gzfp, Read *read, int start, int end) 
+bool append_read_to_gzip_fastq(Bgzf_Writer *out, Nob_String_Builder *buf, Read *read, int start, int end) 
 {
     int length = read->len;  
     if (start < 0) start = 0;
@@ -323,24 +2595,19 @@ bool append_read_to_gzip_fastq(gzFile gzfp, Read *read, int start, int end)
     }
     
     size_t trimmed_length = end - start;
-    int ret = gzprintf(
-        gzfp, 
-        "@%s\n"
-        "%.*s\n"
-        "+\n"
-        "%.*s\n", 
-        read->name, 
-        (int)trimmed_length, read->seq + start,
-        (int)trimmed_length, read->qual + start
-    );
-    
-    if (ret < 0) {
-        printf("ERROR: Failed to write FASTQ record\n");
-        return false;
-    }
+    fastq_append_record(buf, read->name, read->name_len, read->seq + start, read->qual + start, trimmed_length);
+    if (buf->count >= FASTQ_FLUSH_SIZE) return flush_fastq_buffer(out, buf);
     return true;
 }
 
+bool flush_fastq_buffer(Bgzf_Writer *out, Nob_String_Builder *buf)
+{
+    bool ok = bgzf_write(out, buf->items, buf->count);
+    buf->count = 0;
+    if (!ok) printf("ERROR: Failed to write FASTQ records\n");
+    return ok;
+}
+
 char *basename(char const *path) 
 {
     char *s = strrchr(path, '/');
@@ -350,19 +2617,141 @@ char *basename(char const *path)
         return strdup(s + 1);
 }
 
-double average_qual(const char *quals, size_t len) 
+// ---- quality ----
+
+// Error probability of every quality byte. Indexed by the unsigned byte but
+// filled from its char value, so bytes outside the Phred+33 range give the
+// same result as the direct formula did.
+static double phred_error_table[256];
+static Simd_Level phred_level;
+static pthread_once_t phred_once = PTHREAD_ONCE_INIT;
+
+static void phred_init(void)
 {
-    double probability_sum = 0.0;
-    for (size_t i = 0; i < len; i++) {
-        int phred_score = quals[i] - 33;  
-        probability_sum += pow(10.0, phred_score / -10.0);
+    for (int b = 0; b < 256; b++) {
+        int phred_score = (char)b - 33;
+        phred_error_table[b] = pow(10.0, phred_score / -10.0);
+    }
+    phred_level = simd_level_detect();
+}
+
+static double phred_error_sum_scalar(const uint8_t *quals, size_t len)
+{
+    double sum = 0.0;
+    for (size_t i = 0; i < len; i++) sum += phred_error_table[quals[i]];
+    return sum;
+}
+
+#ifdef COMMON_X86_SIMD
+// Widens 8 quality bytes to indices and gathers their probabilities into two
+// vectors of 4 partial sums.
+__attribute__((target("avx2")))
+static double phred_error_sum_avx2(const uint8_t *quals, size_t len)
+{
+    __m256d acc_lo = _mm256_setzero_pd();
+    __m256d acc_hi = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(quals + i)));
+        acc_lo = _mm256_add_pd(acc_lo, _mm256_i32gather_pd(phred_error_table, _mm256_castsi256_si128(idx), 8));
+        acc_hi = _mm256_add_pd(acc_hi, _mm256_i32gather_pd(phred_error_table, _mm256_extracti128_si256(idx, 1), 8));
     }
-    return log10(probability_sum / len) * -10.0;
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(acc_lo, acc_hi));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + phred_error_sum_scalar(quals + i, len - i);
+}
+#endif
+
+double phred_error_sum_level(const char *quals, size_t len, Simd_Level level)
+{
+    pthread_once(&phred_once, phred_init);
+#ifdef COMMON_X86_SIMD
+    if (level >= SIMD_AVX2) return phred_error_sum_avx2((const uint8_t *)quals, len);
+#endif
+    (void)level;
+    return phred_error_sum_scalar((const uint8_t *)quals, len);
+}
+
+// Sum of the error probabilities of all bases, using the best kernel the CPU
+// supports. Filters that need the expected number of errors can use it as is.
+double phred_error_sum(const char *quals, size_t len)
+{
+    pthread_once(&phred_once, phred_init);
+    return phred_error_sum_level(quals, len, phred_level);
+}
+
+double average_qual(const char *quals, size_t len) 
+{
+    return log10(phred_error_sum(quals, len) / len) * -10.0;
+}
+
+static bool has_suffix(const char *s, size_t len, const char *suffix)
+{
+    size_t n = strlen(suffix);
+    return len >= n && memcmp(s + len - n, suffix, n) == 0;
 }
 
+// True for names ending in .fastq or .fq, optionally followed by .gz, so the
+// .gzi indexes written next to outputs are not taken for reads.
 bool is_fastq(const char *file) 
 {
-    return strstr(file, "fastq") || strstr(file, "fq");
+    size_t len = strlen(file);
+    if (has_suffix(file, len, ".gz")) len -= 3;
+    return has_suffix(file, len, ".fastq") || has_suffix(file, len, ".fq");
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// Expands an input argument into the FASTQ files to read: the FASTQ files of
+// a directory in name order, a single file, or a comma-separated list of files.
+bool collect_fastq_inputs(const char *input, Nob_File_Paths *paths)
+{
+    if (strchr(input, ',')) {
+        Nob_String_View list = nob_sv_from_cstr(input);
+        while (list.count > 0) {
+            Nob_String_View item = nob_sv_trim(nob_sv_chop_by_delim(&list, ','));
+            if (item.count == 0) continue;
+            const char *file = nob_temp_sv_to_cstr(item);
+            if (nob_get_file_type(file) != NOB_FILE_REGULAR) {
+                nob_log(NOB_ERROR, "%s is not a file", file);
+                return false;
+            }
+            nob_da_append(paths, strdup(file));
+        }
+        return paths->count > 0;
+    }
+
+    switch (nob_get_file_type(input)) {
+        case NOB_FILE_DIRECTORY: {
+            Nob_File_Paths files = {0};
+            if (!nob_read_entire_dir(input, &files)) {
+                nob_log(NOB_ERROR, "Failed to read directory %s", input);
+                return false;
+            }
+            qsort(files.items, files.count, sizeof(*files.items), compare_paths);
+            for (size_t i = 0; i < files.count; i++) {
+                const char *file = files.items[i];
+                if (*file == '.') continue;
+                if (!is_fastq(file)) continue;
+                nob_da_append(paths, strdup(nob_temp_sprintf("%s/%s", input, file)));
+            }
+            nob_da_free(files);
+            if (paths->count == 0) {
+                nob_log(NOB_ERROR, "%s contains no fastq files", input);
+                return false;
+            }
+            return true;
+        }
+        case NOB_FILE_REGULAR:
+            nob_da_append(paths, strdup(input));
+            return true;
+        default:
+            nob_log(NOB_ERROR, "input: %s has an unknown type", input);
+            return false;
+    }
 }
 
 bool must_be_digit(const char *arg) 
@@ -34,6 +34,12 @@
 #include <string.h>
 #include <stdlib.h>
 
+/* Read-ahead buffer of each stream. A nanopore read is tens of kilobytes,
+   so a large buffer keeps whole records in one refill. */
+#ifndef KSEQ_BUFSIZE
+#define KSEQ_BUFSIZE (1 << 20)
+#endif
+
 #define KS_SEP_SPACE 0 // isspace(): \t, \n, \v, \f, \r
 #define KS_SEP_TAB   1 // isspace() && !' '
 #define KS_SEP_MAX   1
@@ -106,8 +112,8 @@ typedef struct __kstring_t {
 				} else break;											\
 			}															\
 			if (delimiter > KS_SEP_MAX) {								\
-				for (i = ks->begin; i < ks->end; ++i)					\
-					if (ks->buf[i] == delimiter) break;					\
+				char *p = (char*)memchr(ks->buf + ks->begin, delimiter, ks->end - ks->begin); \
+				i = p ? (int)(p - ks->buf) : ks->end;					\
 			} else if (delimiter == KS_SEP_SPACE) {						\
 				for (i = ks->begin; i < ks->end; ++i)					\
 					if (isspace(ks->buf[i])) break;						\
@@ -136,11 +142,83 @@ typedef struct __kstring_t {
 		return str->l;													\
 	}
 
+/* Line-at-a-time helpers for kseq_read: whole lines are located with memchr
+   and copied in one go instead of one ks_getc() per byte. */
+#define __KS_LINES(__read, __bufsize)									\
+	static inline void ks_reserve(kstring_t *str, size_t size)			\
+	{																	\
+		if (str->m < size) {											\
+			str->m = size;												\
+			kroundup32(str->m);											\
+			str->s = (char*)realloc(str->s, str->m);					\
+		}																\
+	}																	\
+	static inline int ks_fill(kstream_t *ks)							\
+	{																	\
+		if (ks->begin < ks->end) return 1;								\
+		if (ks->is_eof) return 0;										\
+		ks->begin = 0;													\
+		ks->end = __read(ks->f, ks->buf, __bufsize);					\
+		if (ks->end < __bufsize) ks->is_eof = 1;						\
+		return ks->end > 0;												\
+	}																	\
+	/* drops the bytes of str from index from on that aren't printable */ \
+	static inline void ks_keep(kstring_t *str, size_t from, int lo, int hi) \
+	{																	\
+		size_t j = from;												\
+		for (size_t i = from; i < str->l; ++i) {						\
+			int c = str->s[i];											\
+			if (c >= lo && c <= hi) str->s[j++] = (char)c;				\
+		}																\
+		str->l = j;														\
+	}																	\
+	/* appends the printable characters up to the next '\n', which is consumed */ \
+	static void ks_append_line(kstream_t *ks, kstring_t *str)			\
+	{																	\
+		while (ks_fill(ks)) {											\
+			char *p = (char*)memchr(ks->buf + ks->begin, '\n', ks->end - ks->begin); \
+			int i = p ? (int)(p - ks->buf) : ks->end;					\
+			size_t from = str->l;										\
+			ks_reserve(str, str->l + (i - ks->begin) + 1);				\
+			memcpy(str->s + str->l, ks->buf + ks->begin, i - ks->begin); \
+			str->l += i - ks->begin;									\
+			ks_keep(str, from, 33, 126);								\
+			ks->begin = p ? i + 1 : i;									\
+			if (p) break;												\
+		}																\
+	}																	\
+	static int ks_skip_line(kstream_t *ks)								\
+	{																	\
+		while (ks_fill(ks)) {											\
+			char *p = (char*)memchr(ks->buf + ks->begin, '\n', ks->end - ks->begin); \
+			if (p) {													\
+				ks->begin = (int)(p - ks->buf) + 1;						\
+				return '\n';											\
+			}															\
+			ks->begin = ks->end;										\
+		}																\
+		return -1;														\
+	}																	\
+	/* reads quality characters until qual is as long as seq */		\
+	static void ks_read_qual(kstream_t *ks, kstring_t *qual, size_t len) \
+	{																	\
+		while (qual->l < len && ks_fill(ks)) {							\
+			size_t n = len - qual->l;									\
+			if (n > (size_t)(ks->end - ks->begin)) n = ks->end - ks->begin; \
+			size_t from = qual->l;										\
+			memcpy(qual->s + qual->l, ks->buf + ks->begin, n);			\
+			qual->l += n;												\
+			ks->begin += n;												\
+			ks_keep(qual, from, 33, 127);								\
+		}																\
+	}
+
 #define KSTREAM_INIT(type_t, __read, __bufsize) \
 	__KS_TYPE(type_t)							\
 	__KS_BASIC(type_t, __bufsize)				\
 	__KS_GETC(__read, __bufsize)				\
-	__KS_GETUNTIL(__read, __bufsize)
+	__KS_GETUNTIL(__read, __bufsize)			\
+	__KS_LINES(__read, __bufsize)
 
 #define __KSEQ_BASIC(type_t)											\
 	static inline kseq_t *kseq_init(type_t fd)							\
@@ -181,26 +259,20 @@ typedef struct __kstring_t {
 		if (ks_getuntil(ks, 0, &seq->name, &c) < 0) return -1;			\
 		if (c != '\n') ks_getuntil(ks, '\n', &seq->comment, 0);			\
 		while ((c = ks_getc(ks)) != -1 && c != '>' && c != '+' && c != '@') { \
-			if (isgraph(c)) { /* printable non-space character */		\
-				if (seq->seq.l + 1 >= seq->seq.m) { /* double the memory */ \
-					seq->seq.m = seq->seq.l + 2;						\
-					kroundup32(seq->seq.m); /* rounded to next closest 2^k */ \
-					seq->seq.s = (char*)realloc(seq->seq.s, seq->seq.m); \
-				}														\
+			if (isgraph(c)) { /* a sequence line: take the rest of it at once */ \
+				ks_reserve(&seq->seq, seq->seq.l + 2);					\
 				seq->seq.s[seq->seq.l++] = (char)c;						\
+				ks_append_line(ks, &seq->seq);							\
 			}															\
 		}																\
 		if (c == '>' || c == '@') seq->last_char = c; /* the first header char has been read */	\
+		ks_reserve(&seq->seq, seq->seq.l + 1);							\
 		seq->seq.s[seq->seq.l] = 0;	/* null terminated string */		\
 		if (c != '+') return seq->seq.l; /* FASTA */					\
-		if (seq->qual.m < seq->seq.m) {	/* allocate enough memory */	\
-			seq->qual.m = seq->seq.m;									\
-			seq->qual.s = (char*)realloc(seq->qual.s, seq->qual.m);		\
-		}																\
-		while ((c = ks_getc(ks)) != -1 && c != '\n'); /* skip the rest of '+' line */ \
-		if (c == -1) return -2; /* we should not stop here */			\
-		while ((c = ks_getc(ks)) != -1 && seq->qual.l < seq->seq.l)		\
-			if (c >= 33 && c <= 127) seq->qual.s[seq->qual.l++] = (unsigned char)c;	\
+		ks_reserve(&seq->qual, seq->seq.l + 1); /* allocate enough memory */ \
+		if (ks_skip_line(ks) == -1) return -2; /* skip the rest of '+' line */ \
+		ks_read_qual(ks, &seq->qual, seq->seq.l);						\
+		if (seq->qual.l == seq->seq.l) ks_getc(ks); /* the character after the quality */ \
 		seq->qual.s[seq->qual.l] = 0; /* null terminated string */		\
 		seq->last_char = 0;	/* we have not come to the next header line */ \
 		if (seq->seq.l != seq->qual.l) return -2; /* qual string is shorter than seq string */ \
@@ -215,7 +287,7 @@ typedef struct __kstring_t {
 	} kseq_t;
 
 #define KSEQ_INIT(type_t, __read)				\
-	KSTREAM_INIT(type_t, __read, 4096)			\
+	KSTREAM_INIT(type_t, __read, KSEQ_BUFSIZE)	\
 	__KSEQ_TYPE(type_t)							\
 	__KSEQ_BASIC(type_t)						\
 	__KSEQ_READ
@@ -1,5 +1,5 @@
-#define NOB_IMPLEMENTATION
-#include "nob.h"
+#define COMMON_IMPLEMENTATION
+#include "common.h"
 #include "kseq.h"
 #include <stdio.h>
 #include <zlib.h>
@@ -19,15 +19,6 @@ uint32_t djb2(const char *buf, size_t buf_size) {
 }
 
 
-char *basename(char const *path) {
-    char *s = strrchr(path, '/');
-    if (!s)
-        return strdup(path);
-    else
-        return strdup(s + 1);
-}
-
-
 #define hash_init(ht, cap) \
     do { \
         (ht)->items = malloc(sizeof(*(ht)->items)*cap); \
@@ -39,7 +30,7 @@ char *basename(char const *path) {
 #define hash_resize(ht) \
     do { \
         size_t new_capacity = (ht)->capacity * 2; \
-        Read *new_items = malloc(sizeof(*(ht)->items) * new_capacity); \
+        Dup_Entry *new_items = malloc(sizeof(*(ht)->items) * new_capacity); \
         if (!new_items) { \
             nob_log(NOB_ERROR, "Failed to allocate memory for hash table resize"); \
             break; \
@@ -47,7 +38,7 @@ char *basename(char const *path) {
         memset(new_items, 0, sizeof(*(ht)->items) * new_capacity); \
         for (size_t i = 0; i < (ht)->capacity; i++) { \
             if ((ht)->items[i].occupied) { \
-                uint32_t h = djb2((ht)->items[i].key, strlen((ht)->items[i].key)) % new_capacity; \
+                size_t h = (ht)->items[i].hash % new_capacity; \
                 while (new_items[h].occupied) { \
                     h = (h + 1) % new_capacity; \
                 } \
@@ -59,70 +50,32 @@ char *basename(char const *path) {
         (ht)->capacity = new_capacity; \
     } while(0)
 
+// Reads of plain uppercase ACGT are keyed by their packed bases, a quarter of
+// the text; any other read keeps its text as the key.
 typedef struct {
     const char *key;
+    uint64_t *packed;
+    size_t len;
+    uint64_t hash;
     int value;
     bool occupied;
-} Read;
+} Dup_Entry;
+
+static bool dup_entry_matches(const Dup_Entry *e, const Packed_Seq *ps, bool plain)
+{
+    if (plain) return e->packed && e->len == ps->len && memcmp(e->packed, ps->bits, (ps->len + NT_PER_WORD - 1) / NT_PER_WORD * sizeof(uint64_t)) == 0;
+    return e->key && strcmp(e->key, ps->seq) == 0;
+}
 
 typedef struct {
-    Read *items;
+    Dup_Entry *items;
     size_t count;
     size_t capacity;
-} Reads;
-
+} Dup_Table;
 
-bool is_fastq(const char *file) {
-    return strstr(file, "fastq") || strstr(file, "fq") || strstr(file, "fa");
-}
 
-bool must_be_digit(const char *arg) {
-    for(; *arg != '\0'; arg++) {
-        if (!isdigit(*arg)) return false;
-    }
-    return true;
-}
-
-int append_read_to_gzip_fastq(gzFile gzfp, const char *name, const char *seq, const char *qual) {
-    int result = 0;
-    size_t max_len = strlen(seq);
-    size_t buffer_size = max_len + 10; 
-    char *buffer = (char *)malloc(buffer_size);
-
-    if (!buffer) {
-        nob_log(NOB_ERROR, "Memory allocation failed");
-        return 1;
-    }
-
-    int len = snprintf(buffer, buffer_size, "@%s\n", name);
-    if (gzwrite(gzfp, buffer, len) != len) {
-        nob_log(NOB_ERROR, "Failed to write to gzip file");
-        nob_return_defer(1);
-    }
-
-    len = snprintf(buffer, buffer_size, "%s\n", seq);
-    if (gzwrite(gzfp, buffer, len) != len) {
-        nob_log(NOB_ERROR, "Failed to write to gzip file");
-        nob_return_defer(1);
-    }
-
-    if (qual) {
-        len = snprintf(buffer, buffer_size, "+\n");
-        if (gzwrite(gzfp, buffer, len) != len) {
-            nob_log(NOB_ERROR, "Failed to write to gzip file");
-            nob_return_defer(1);
-        }
-
-        len = snprintf(buffer, buffer_size, "%s\n", qual);
-            if (gzwrite(gzfp, buffer, len) != len) {
-                nob_log(NOB_ERROR, "Failed to write to gzip file");
-                nob_return_defer(1);
-            }
-    }
-
-defer:
-    free(buffer);
-    return result;
+bool is_fastx(const char *file) {
+    return is_fastq(file) || strstr(file, "fa");
 }
 
 typedef struct {
@@ -131,6 +84,8 @@ typedef struct {
     char *log_file_file;
     FILE *log_file_all;
     pthread_mutex_t *log_file_all_mutex;
+    threadpool compress_pool;
+    bool write_index;
 } File; 
 
 typedef struct {
@@ -148,18 +103,20 @@ bool nanodup_file(File *file) {
         nob_log(NOB_INFO, "Failed to open fastq file: '%s'", file->in_file);
         return false;
     }
-    gzFile out_file = gzopen(file->clean_file, "wb"); 
+    Bgzf_Writer *out_file = bgzf_open(file->clean_file, "wb", file->compress_pool, file->write_index);
     if (!out_file) {
         nob_log(NOB_ERROR, "Failed to open %s file, exiting", file->clean_file);
         return false;
     }
 
-    Reads ht = {0};
+    Nob_String_Builder buf = {0};
+    Dup_Table ht = {0};
     hash_init(&ht, 1024*10);
 
     int l;
     kseq_t *seq = kseq_init(fp); 
     int num_reads = 0;
+    Packed_Seq packed = {0};
 
     while ((l = kseq_read(seq)) >= 0) { 
 
@@ -167,28 +124,47 @@ bool nanodup_file(File *file) {
             hash_resize(&ht);
         }
 
-        uint32_t h = djb2(seq->seq.s, strlen(seq->seq.s))%ht.capacity;
-        for (size_t i = 0; i < ht.capacity && ht.items[h].occupied && strcmp(ht.items[h].key, seq->seq.s) != 0; ++i) {
+        if (!packed_seq_pack(&packed, seq->seq.s, seq->seq.l)) {
+            nob_log(NOB_ERROR, "Could not allocate memory for %s", file->in_file);
+            return false;
+        }
+        bool plain = !packed.has_lower && !packed_seq_has_n(&packed);
+        uint64_t hash = plain ? packed_seq_hash(&packed) : djb2(seq->seq.s, seq->seq.l);
+        size_t h = hash % ht.capacity;
+        for (size_t i = 0; i < ht.capacity && ht.items[h].occupied && !dup_entry_matches(&ht.items[h], &packed, plain); ++i) {
             h = (h + 1)%ht.capacity;
         }
 
         if (ht.items[h].occupied) {
-            if (strcmp(ht.items[h].key, seq->seq.s) != 0) {
+            if (!dup_entry_matches(&ht.items[h], &packed, plain)) {
                 nob_log(NOB_ERROR, "Table overflow");
                 return false;
             }
             ht.items[h].value += 1;
         } else {
             ht.items[h].occupied = true;
-            ht.items[h].key = strdup(seq->seq.s);
+            ht.items[h].hash = hash;
+            ht.items[h].len = seq->seq.l;
+            if (plain) {
+                size_t size = (seq->seq.l + NT_PER_WORD - 1) / NT_PER_WORD * sizeof(uint64_t);
+                ht.items[h].packed = malloc(size);
+                if (ht.items[h].packed) memcpy(ht.items[h].packed, packed.bits, size);
+            } else {
+                ht.items[h].key = strdup(seq->seq.s);
+            }
+            if (!ht.items[h].packed && !ht.items[h].key) {
+                nob_log(NOB_ERROR, "Could not allocate memory for %s", file->in_file);
+                return false;
+            }
             ht.items[h].value = 1;
             ht.count++;
-            append_read_to_gzip_fastq(out_file, seq->name.s, seq->seq.s, seq->qual.s);
+            fastq_append_record(&buf, seq->name.s, seq->name.l, seq->seq.s, seq->qual.l ? seq->qual.s : NULL, seq->seq.l);
+            if (buf.count >= FASTQ_FLUSH_SIZE && !flush_fastq_buffer(out_file, &buf)) return false;
         }
         num_reads += 1;
     }
 
-    Reads freq = {0};
+    Dup_Table freq = {0};
     for (size_t i = 0; i < ht.capacity; ++i) {
         if (ht.items[i].occupied) {
             nob_da_append(&freq, ht.items[i]);
@@ -198,11 +174,19 @@ bool nanodup_file(File *file) {
     FILE *log_file_file = fopen(file->log_file_file, "ab");
     fprintf(log_file_file, "read,count\n");
 
+    Nob_String_Builder text = {0};
     for (size_t i = 0; i < freq.count; ++i) {
-        if (freq.items[i].value > 1) {
-            fprintf(log_file_file, "%s,%i\n", freq.items[i].key, freq.items[i].value);
+        Dup_Entry *e = &freq.items[i];
+        if (e->value <= 1) continue;
+        const char *read = e->key;
+        if (e->packed) {
+            nob_da_reserve(&text, e->len + 1);
+            packed_seq_unpack(&(Packed_Seq){ .bits = e->packed, .len = e->len }, text.items);
+            read = text.items;
         }
+        fprintf(log_file_file, "%s,%i\n", read, e->value);
     }
+    nob_sb_free(text);
 
     // log file all
     pthread_mutex_lock(file->log_file_all_mutex);
@@ -213,9 +197,14 @@ bool nanodup_file(File *file) {
 
     kseq_destroy(seq); 
     gzclose(fp); 
-    gzclose(out_file);
+    packed_seq_free(&packed);
+    bool written = flush_fastq_buffer(out_file, &buf);
+    if (!bgzf_close(out_file) || !written) {
+        nob_log(NOB_ERROR, "Failed to finish %s", file->clean_file);
+    }
     fclose(log_file_file);
     nob_da_free(ht);
+    nob_sb_free(buf);
 
     return true;
 }
@@ -232,7 +221,8 @@ char *usage =
 "[USAGE]: nanodup -i <input> -o <output> [options]\n"
 "   -i    <input>             Path of folder or file\n"
 "   -o    <output>            Name of output folder.\n"
-"   -t    <threads>           Number of threads to use. Optional: Default 1\n";
+"   -t    <threads>           Number of threads to use. Optional: Default 1\n"
+"   -g                        Write a .gzi block index next to each output. Optional\n";
 
 int main(int argc, char **argv) {
 
@@ -245,7 +235,8 @@ int main(int argc, char **argv) {
 
     char c;
     int t_arg = 1;
-    while ((c = getopt(argc, argv, "i:o:t:")) != -1) {
+    bool g_arg = false;
+    while ((c = getopt(argc, argv, "i:o:t:g")) != -1) {
         switch (c) {
             case 'i':
                 i_arg = true;
@@ -263,6 +254,9 @@ int main(int argc, char **argv) {
                 }
                 t_arg = atoi(optarg);
                 break;
+            case 'g':
+                g_arg = true;
+                break;
             }
     }
     if (!(i_arg)) {
@@ -285,6 +279,9 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    // Output blocks are compressed on their own pool: the file jobs wait for them.
+    threadpool compress_pool = thpool_init(t_arg);
+
     Nob_File_Type type = nob_get_file_type(input);
     Nob_File_Paths files = {0};
     Files fastq_files = {0};
@@ -316,7 +313,7 @@ int main(int argc, char **argv) {
                 if (strcmp(file, ".") == 0) continue;
                 if (strcmp(file, "..") == 0) continue;
                 if (*file == '.') continue;
-                if (!is_fastq(file)) continue;
+                if (!is_fastx(file)) continue;
 
                 char *base_name = basename(file);
                 char in_file[1024];
@@ -331,13 +328,15 @@ int main(int argc, char **argv) {
                     .log_file_file = strdup(file_log_file),
                     .log_file_all = LOG_FILE_ALL,
                     .log_file_all_mutex = &log_file_mutex,
+                    .compress_pool = compress_pool,
+                    .write_index = g_arg,
                 };
                 nob_da_append(&fastq_files, fastq_file);
             }
             break;
         }
         case NOB_FILE_REGULAR: {
-            if (!is_fastq(input)) {
+            if (!is_fastx(input)) {
                 nob_log(NOB_ERROR, "`%s` is not a fastq file...", input);
                 return 1;
             }
@@ -356,6 +355,8 @@ int main(int argc, char **argv) {
                 .log_file_file = strdup(file_log_file),
                 .log_file_all = LOG_FILE_ALL,
                 .log_file_all_mutex = &log_file_mutex,
+                .compress_pool = compress_pool,
+                .write_index = g_arg,
             };
 
             nob_da_append(&fastq_files, fastq_file);
@@ -375,6 +376,7 @@ int main(int argc, char **argv) {
 
 	thpool_wait(thpool);
 	thpool_destroy(thpool);
+	thpool_destroy(compress_pool);
     pthread_mutex_destroy(&log_file_mutex);
     nob_log(NOB_INFO, "nanodup done!");
 
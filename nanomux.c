@@ -32,119 +32,912 @@
 #include <pthread.h>
 
 #define READ_BUFFER 10 * 1000
-KSEQ_INIT(gzFile, gzread)
+KSEQ_INIT(Gz_Reader *, gz_reader_read)
 
+#define CHUNKS_PER_THREAD 4
+
+// Calibration keeps the narrowest windows that still cover this share of the
+// sampled hits at each end, moving both the start and the end in, and leaves an end at -p when it saw fewer than
+// CALIBRATION_MIN_HITS hits.
+#define CALIBRATION_COVERAGE 0.999
+#define CALIBRATION_MIN_HITS 100
+
+// Barcode search windows: [first_start, first_end) counted from the 5' end
+// of a read and [last_start, last_end) counted back from its 3' end. The read
+// slices searched are views of exactly these spans.
 typedef struct {
-    Barcode *barcode;
+    size_t first_start;
+    size_t first_end;
+    size_t last_start;
+    size_t last_end;
+} Windows;
+
+// Reads must be longer than both windows reach.
+static inline bool windows_fit(Windows w, size_t len)
+{
+    return len > w.first_end && len > w.last_end;
+}
+
+static inline void windows_slice(Windows w, Read *read)
+{
+    read->first_slice = read->seq + w.first_start;
+    read->last_slice = read->seq + read->len - w.last_end;
+}
+
+typedef struct {
+    size_t read_idx;
+    int start;
+    int end;
+} Match;
+
+// Reads assigned to one output bin within one chunk of reads. hits also
+// counts matches that are too short to be written.
+typedef struct {
+    Match *items;
+    size_t count;
+    size_t capacity;
+    size_t hits;
+} Matches;
+
+typedef struct Barcode_Sets Barcode_Sets;
+
+// Every read goes to exactly one output bin: its best barcode, or one of these
+// two, which follow the barcode bins. Ambiguous reads match several barcodes
+// equally well; unclassified ones match none or are too short to search.
+enum {
+    BIN_AMBIGUOUS,
+    BIN_UNCLASSIFIED,
+    N_EXTRA_BINS,
+};
+
+static const char *extra_bin_names[N_EXTRA_BINS] = { "ambiguous", "unclassified" };
+
+// Classification by a header field the basecaller wrote, such as barcode=.
+// Reads whose field names no single barcode row are searched by sequence when
+// verify is set, and go to the unclassified or ambiguous bin otherwise.
+typedef struct {
+    const char *key;
+    size_t key_len;
+    Tag_Table table;
+    bool verify;
+} Header_Tags;
+
+typedef struct {
+    Barcodes *barcodes;
+    Barcode_Sets *sets;
+    const Header_Tags *tags;
     Reads *reads;
-    size_t barcode_pos;
+    size_t start;
+    size_t end;
+    Matches *matches;
+    size_t n_bins;
+    Windows windows;
     size_t k;
     bool trim;
     int barcode_schema;
+    Latch *latch;
 } Thread_Data;
 
-void process_barcode(void *arg) 
+typedef struct {
+    Barcode *barcode;
+    Reads *reads;
+    Matches *chunk_matches;
+    size_t n_chunks;
+    size_t bin;
+    size_t n_bins;
+    Batch_Queue *out_buffers;
+    Latch *latch;
+} Write_Data;
+
+// One buffered batch of the pipeline together with its match lists, which
+// travel with it from the match stage to the write stage.
+typedef struct {
+    Read_Batch batch;
+    Matches *chunk_matches;
+    Latch latch;
+} Mux_Batch;
+
+// A unit of reader work: a compressed input as a whole, or a byte range of
+// whole records in a mapped plain FASTQ file.
+typedef struct {
+    const char *path;
+    Mapped_File *map;
+    size_t start;
+    size_t end;
+} Input_Range;
+
+typedef struct {
+    Input_Range *items;
+    size_t count;
+    size_t capacity;
+} Input_Ranges;
+
+// Plain files of at least this size are parsed by several readers at once.
+#define MAPPED_RANGE_MIN (16 * 1000 * 1000)
+
+// Shared by the reader threads, which claim the input ranges one at a time.
+// The last reader to finish closes full_batches.
+typedef struct {
+    Input_Ranges *inputs;
+    threadpool inflate_pool;
+    size_t next_input;
+    size_t active;
+    pthread_mutex_t mutex;
+    Batch_Queue *free_batches;
+    Batch_Queue *full_batches;
+    Windows windows;
+    bool keep_comments;
+    size_t counter;
+    size_t reads_shorter_than_p;
+} Reader;
+
+typedef struct {
+    threadpool thpool;
+    Barcode **bins;
+    size_t n_bins;
+    Batch_Queue *write_batches;
+    Batch_Queue *free_batches;
+    Batch_Queue *out_buffers;
+    size_t n_chunks;
+} Writer;
+
+static void add_match(Matches *matches, size_t read_idx, int start, int end)
 {
-    Thread_Data *td = (Thread_Data *)arg;
-    Barcode *b = td->barcode;
-    size_t k = td->k;
-    size_t barcode_pos = td->barcode_pos;
-    bool trim = td->trim;
-    int barcode_schema = td->barcode_schema;
+    matches->hits++;
+    if (end <= 0) return;
+    Match match = { .read_idx = read_idx, .start = start, .end = end };
+    nob_da_append(matches, match);
+}
+
+// Marks a forward/reverse pair used by several rows of the barcode file. Reads
+// carrying it can't be told apart and go to the ambiguous bin.
+#define PAIR_SHARED -2
+
+// One pattern set per barcode orientation over the distinct barcode
+// sequences, so a sequence shared by many rows (combinatorial dual indexing)
+// is aligned once per read end. fw_index and rv_index give the sequences of
+// each row, and pairs, an n_fw x n_rv table, the row of each (forward,
+// reverse) pair: -1 if no row uses it. Single barcodes have n_rv = 1.
+struct Barcode_Sets {
+    Pattern_Set fw;
+    Pattern_Set fw_comp;
+    Pattern_Set rv;
+    Pattern_Set rv_comp;
+    const Bit_Pattern **patterns;
+    size_t n_fw;
+    size_t n_rv;
+    size_t *fw_index;
+    size_t *rv_index;
+    int *pairs;
+};
+
+// Best hits of one pattern set in a read slice (end position and edit
+// distance, or -1), and the patterns that have one.
+typedef struct {
+    int *ends;
+    int *dists;
+    size_t *hits;
+    size_t n_hits;
+} Slice_Hits;
+
+// Per-thread search state: the hits of each set and the two read slices,
+// packed once and searched by every set on that end.
+typedef struct {
+    Slice_Hits fw;
+    Slice_Hits fw_comp;
+    Slice_Hits rv;
+    Slice_Hits rv_comp;
+    Packed_Seq first;
+    Packed_Seq last;
+} Read_Hits;
+
+// A barcode found in a read: total edit distance of the barcode ends it
+// needs, how far they sit from the read ends, and the part of the read to
+// write. At each end the barcode lies within [skip, span) counted from that
+// read end: first_span and last_span are the window lengths the hit needs,
+// first_skip and last_skip the bases before it that a window may leave out,
+// all -1 for an end without a barcode.
+typedef struct {
+    int dist;
+    int offset;
+    int start;
+    int end;
+    int first_span;
+    int last_span;
+    int first_skip;
+    int last_skip;
+} Hit;
+
+// The best barcode of a read so far: a row, PAIR_SHARED, or -1 while nothing
+// matched. tied is set while another row has an equally good hit.
+typedef struct {
+    Hit hit;
+    int barcode;
+    bool tied;
+} Best_Hit;
+
+// Index of pattern among the distinct patterns, which it is added to if new.
+static size_t distinct_pattern(const Bit_Pattern **distinct, const Bit_Pattern **distinct_comp, size_t *count, const Bit_Pattern *pattern, const Bit_Pattern *comp)
+{
+    for (size_t i = 0; i < *count; i++) {
+        if (distinct[i]->len == pattern->len && memcmp(distinct[i]->needle, pattern->needle, pattern->len) == 0) return i;
+    }
+    distinct[*count] = pattern;
+    distinct_comp[*count] = comp;
+    return (*count)++;
+}
+
+static bool barcode_sets_init(Barcode_Sets *sets, Barcodes *barcodes, int barcode_schema, size_t k)
+{
+    size_t n = barcodes->count;
+    memset(sets, 0, sizeof(*sets));
+    sets->patterns = malloc((4 * n + 1) * sizeof(Bit_Pattern *));
+    sets->fw_index = malloc((n + 1) * sizeof(size_t));
+    sets->rv_index = calloc(n + 1, sizeof(size_t));
+    if (!sets->patterns || !sets->fw_index || !sets->rv_index) return false;
+    const Bit_Pattern **fw = sets->patterns;
+    const Bit_Pattern **fw_comp = sets->patterns + n;
+    const Bit_Pattern **rv = sets->patterns + 2 * n;
+    const Bit_Pattern **rv_comp = sets->patterns + 3 * n;
+    for (size_t i = 0; i < n; i++) {
+        Barcode *b = &barcodes->items[i];
+        sets->fw_index[i] = distinct_pattern(fw, fw_comp, &sets->n_fw, &b->fw_pattern, &b->fw_comp_pattern);
+        if (barcode_schema == 2) {
+            sets->rv_index[i] = distinct_pattern(rv, rv_comp, &sets->n_rv, &b->rv_pattern, &b->rv_comp_pattern);
+        }
+    }
+    if (barcode_schema != 2) sets->n_rv = 1;
+
+    sets->pairs = malloc((sets->n_fw * sets->n_rv + 1) * sizeof(int));
+    if (!sets->pairs) return false;
+    for (size_t i = 0; i < sets->n_fw * sets->n_rv; i++) sets->pairs[i] = -1;
+    for (size_t i = 0; i < n; i++) {
+        int *pair = &sets->pairs[sets->fw_index[i] * sets->n_rv + sets->rv_index[i]];
+        *pair = *pair == -1 ? (int)i : PAIR_SHARED;
+    }
+
+    if (!pattern_set_init(&sets->fw, fw, sets->n_fw)) return false;
+    if (!pattern_set_init(&sets->fw_comp, fw_comp, sets->n_fw)) return false;
+    if (!pattern_set_build_seed_index(&sets->fw, k)) return false;
+    if (!pattern_set_build_seed_index(&sets->fw_comp, k)) return false;
+    if (!pattern_set_build_neighbourhood(&sets->fw, k, NEIGHBOURHOOD_MAX_ENTRIES)) return false;
+    if (!pattern_set_build_neighbourhood(&sets->fw_comp, k, NEIGHBOURHOOD_MAX_ENTRIES)) return false;
+    if (barcode_schema == 2) {
+        if (!pattern_set_init(&sets->rv, rv, sets->n_rv)) return false;
+        if (!pattern_set_init(&sets->rv_comp, rv_comp, sets->n_rv)) return false;
+        if (!pattern_set_build_seed_index(&sets->rv, k)) return false;
+        if (!pattern_set_build_seed_index(&sets->rv_comp, k)) return false;
+        if (!pattern_set_build_neighbourhood(&sets->rv, k, NEIGHBOURHOOD_MAX_ENTRIES)) return false;
+        if (!pattern_set_build_neighbourhood(&sets->rv_comp, k, NEIGHBOURHOOD_MAX_ENTRIES)) return false;
+    }
+    return true;
+}
+
+// Smallest edit distance between two distinct sequences of a set, or -1 for
+// a set of fewer than two.
+static int min_pattern_distance(const Pattern_Set *set)
+{
+    int best = -1;
+    for (size_t i = 0; i < set->count; i++) {
+        const Bit_Pattern *a = set->patterns[i];
+        for (size_t j = i + 1; j < set->count; j++) {
+            const Bit_Pattern *b = set->patterns[j];
+            int d = barcode_distance(a->needle, a->len, b->needle, b->len);
+            if (best == -1 || d < best) best = d;
+        }
+    }
+    return best;
+}
+
+static void barcode_sets_free(Barcode_Sets *sets)
+{
+    pattern_set_free(&sets->fw);
+    pattern_set_free(&sets->fw_comp);
+    pattern_set_free(&sets->rv);
+    pattern_set_free(&sets->rv_comp);
+    free(sets->patterns);
+    free(sets->fw_index);
+    free(sets->rv_index);
+    free(sets->pairs);
+}
+
+static bool slice_hits_init(Slice_Hits *h, size_t count)
+{
+    h->ends = malloc((count + 1) * sizeof(int));
+    h->dists = malloc((count + 1) * sizeof(int));
+    h->hits = malloc((count + 1) * sizeof(size_t));
+    h->n_hits = 0;
+    return h->ends && h->dists && h->hits;
+}
+
+static void slice_hits_free(Slice_Hits *h)
+{
+    free(h->ends);
+    free(h->dists);
+    free(h->hits);
+}
+
+static void slice_hits_search(Slice_Hits *h, const Pattern_Set *set, const Packed_Seq *slice, size_t k)
+{
+    h->n_hits = 0;
+    if (set->count == 0) return;
+    pattern_set_search(set, slice, k, h->ends, h->dists);
+    for (size_t p = 0; p < set->count; p++) {
+        if (h->ends[p] != -1) h->hits[h->n_hits++] = p;
+    }
+}
+
+static inline bool hit_better(const Hit *a, const Hit *b)
+{
+    return a->dist < b->dist || (a->dist == b->dist && a->offset < b->offset);
+}
+
+// Offers the hit of one row (or of a shared pair). Another hit of the row
+// that is already the best only replaces it when it's better, so earlier
+// candidates win ties within a row.
+static void consider_hit(Best_Hit *best, int barcode, const Hit *hit)
+{
+    if (barcode == -1) return;
+    if (best->barcode == -1 || hit_better(hit, &best->hit)) {
+        best->hit = *hit;
+        best->barcode = barcode;
+        best->tied = false;
+    } else if (barcode != best->barcode && !hit_better(&best->hit, hit)) {
+        best->tied = true;
+    }
+}
+
+// Hit of a barcode at the 3' end, found ending at match_end with dist edits in
+// the last slice, which begins last_window bases before the read end. The 5'
+// barcode, if any, ends at first_end. The match can be up to dist bases longer
+// than the barcode. The caller sets first_skip for a 5' barcode.
+static Hit hit_3prime(int len, int first_end, int match_end, int dist, size_t barcode_len, size_t last_window, bool trim)
+{
+    Hit hit = {
+        .dist = dist,
+        .offset = (int)last_window - match_end,
+        .start = 0,
+        .end = len,
+        .first_span = first_end > 0 ? first_end : -1,
+        .last_span = (int)last_window - match_end + (int)barcode_len + dist,
+        .first_skip = -1,
+        .last_skip = (int)last_window - match_end,
+    };
+    int slice_end = len - (int)last_window + match_end - (int)barcode_len;
+    if (slice_end <= 0) {
+        hit.end = 0;
+    } else if (trim) {
+        hit.start = first_end;
+        hit.end = slice_end;
+    }
+    return hit;
+}
+
+// Finds the best row for a read from the hits of the distinct sequences.
+// Single barcodes may sit at the 5' end or, complemented, at the 3' end. Dual
+// barcodes need both ends, fw ... revcomp(rv) or rv ... revcomp(fw); only the
+// pairs of sequences that hit are looked up in the pair table, so the work
+// grows with the number of hits rather than with the number of rows. Within a
+// row the 5' / forward hit wins a tie.
+// Bases before a 5' barcode ending at end with dist edits, which may be up to
+// dist bases longer than the barcode, but not start before the window.
+static inline int first_skip(int end, int dist, size_t barcode_len, Windows windows)
+{
+    int skip = end - (int)barcode_len - dist;
+    return skip > (int)windows.first_start ? skip : (int)windows.first_start;
+}
+
+static Best_Hit match_read(Read *read, Barcode_Sets *sets, Read_Hits *h, Windows windows, bool trim, int barcode_schema)
+{
+    int len = (int)read->len;
+    Best_Hit best = { .barcode = -1 };
 
     // Single barcode processing
-    if (!(barcode_schema == 1 || barcode_schema == 2)) {
-        printf("ERROR: wrong barcode schema\n");
-        exit(1);
-    } 
     if (barcode_schema == 1) {
-        for (size_t i = 0; i < td->reads->count; i++) {
-            Read *read = &td->reads->items[i];
-            const char *first_read_slice = read->first_slice;
-            const char *last_read_slice = read->last_slice;
-            
-            // Check for barcode in 5' end
-            int match_first_fw = levenshtein_distance(first_read_slice, barcode_pos, b->fw, b->fw_length, k);
-            if (match_first_fw != -1) {
-                b->counter++;
-                if (trim) {
-                    if (!append_read_to_gzip_fastq(b->out_gz, read, match_first_fw, read->len)) exit(1);
-                } else {
-                    if (!append_read_to_gzip_fastq(b->out_gz, read, 0, read->len)) exit(1);
-                }
-            } else {
-                // Check for barcode in 3' end
-                int match_last_rv = levenshtein_distance(last_read_slice, barcode_pos, b->fw_comp, b->fw_length, k);
-                if (match_last_rv != -1) {
-                    b->counter++;
-                    int slice_end = read->len - barcode_pos + match_last_rv - b->fw_length;
-                    if (slice_end <= 0) continue;
-                    if (trim) {
-                        if (!append_read_to_gzip_fastq(b->out_gz, read, 0, slice_end)) exit(1);
-                    } else {
-                        if (!append_read_to_gzip_fastq(b->out_gz, read, 0, read->len)) exit(1);
-                    }
-                }
-            }
+        // Check for barcode in 5' end
+        for (size_t i = 0; i < h->fw.n_hits; i++) {
+            size_t f = h->fw.hits[i];
+            int end = h->fw.ends[f] + (int)windows.first_start;
+            Hit hit = {
+                .dist = h->fw.dists[f],
+                .offset = end - (int)sets->fw.patterns[f]->len,
+                .start = trim ? end : 0,
+                .end = len,
+                .first_span = end,
+                .last_span = -1,
+                .first_skip = first_skip(end, h->fw.dists[f], sets->fw.patterns[f]->len, windows),
+                .last_skip = -1,
+            };
+            consider_hit(&best, sets->pairs[f], &hit);
+        }
+        // Check for barcode in 3' end
+        for (size_t i = 0; i < h->fw_comp.n_hits; i++) {
+            size_t f = h->fw_comp.hits[i];
+            Hit hit = hit_3prime(len, 0, h->fw_comp.ends[f], h->fw_comp.dists[f], sets->fw.patterns[f]->len, windows.last_end, trim);
+            consider_hit(&best, sets->pairs[f], &hit);
         }
+        return best;
     }
 
     // Dual barcode processing
+    // fw ------ revcomp(rv)
+    for (size_t i = 0; i < h->fw.n_hits; i++) {
+        size_t f = h->fw.hits[i];
+        int first_end = h->fw.ends[f] + (int)windows.first_start;
+        for (size_t j = 0; j < h->rv_comp.n_hits; j++) {
+            size_t r = h->rv_comp.hits[j];
+            int barcode = sets->pairs[f * sets->n_rv + r];
+            if (barcode == -1) continue;
+            Hit hit = hit_3prime(len, first_end, h->rv_comp.ends[r], h->rv_comp.dists[r], sets->rv.patterns[r]->len, windows.last_end, trim);
+            hit.dist += h->fw.dists[f];
+            hit.offset += first_end - (int)sets->fw.patterns[f]->len;
+            hit.first_skip = first_skip(first_end, h->fw.dists[f], sets->fw.patterns[f]->len, windows);
+            consider_hit(&best, barcode, &hit);
+        }
+    }
+    // rv ------ revcomp(fw)
+    for (size_t i = 0; i < h->rv.n_hits; i++) {
+        size_t r = h->rv.hits[i];
+        int first_end = h->rv.ends[r] + (int)windows.first_start;
+        for (size_t j = 0; j < h->fw_comp.n_hits; j++) {
+            size_t f = h->fw_comp.hits[j];
+            int barcode = sets->pairs[f * sets->n_rv + r];
+            if (barcode == -1) continue;
+            Hit hit = hit_3prime(len, first_end, h->fw_comp.ends[f], h->fw_comp.dists[f], sets->fw.patterns[f]->len, windows.last_end, trim);
+            hit.dist += h->rv.dists[r];
+            hit.offset += first_end - (int)sets->rv.patterns[r]->len;
+            hit.first_skip = first_skip(first_end, h->rv.dists[r], sets->rv.patterns[r]->len, windows);
+            consider_hit(&best, barcode, &hit);
+        }
+    }
+    return best;
+}
+
+static bool read_hits_init(Read_Hits *h, Barcode_Sets *sets)
+{
+    memset(&h->first, 0, sizeof(h->first));
+    memset(&h->last, 0, sizeof(h->last));
+    return slice_hits_init(&h->fw, sets->n_fw) && slice_hits_init(&h->fw_comp, sets->n_fw) &&
+           slice_hits_init(&h->rv, sets->n_rv) && slice_hits_init(&h->rv_comp, sets->n_rv);
+}
+
+static void read_hits_free(Read_Hits *h)
+{
+    slice_hits_free(&h->fw);
+    slice_hits_free(&h->fw_comp);
+    slice_hits_free(&h->rv);
+    slice_hits_free(&h->rv_comp);
+    packed_seq_free(&h->first);
+    packed_seq_free(&h->last);
+}
+
+// Searches the barcode windows of a read and returns its best barcode.
+static Best_Hit search_read(Read *read, Barcode_Sets *sets, Read_Hits *h, Windows windows, size_t k, bool trim, int barcode_schema)
+{
+    if (!packed_seq_pack(&h->first, read->first_slice, windows.first_end - windows.first_start) ||
+        !packed_seq_pack(&h->last, read->last_slice, windows.last_end - windows.last_start)) {
+        nob_log(NOB_ERROR, "Could not allocate memory for read windows");
+        exit(1);
+    }
+    slice_hits_search(&h->fw, &sets->fw, &h->first, k);
+    slice_hits_search(&h->fw_comp, &sets->fw_comp, &h->last, k);
     if (barcode_schema == 2) {
-        for (size_t i = 0; i < td->reads->count; i++) {
-            Read *read = &td->reads->items[i];
-            const char *first_read_slice = read->first_slice;
-            const char *last_read_slice = read->last_slice;
-            
-            // fw ------ revcomp(rv)
-            int match_first_fw = levenshtein_distance(first_read_slice, barcode_pos, b->fw, b->fw_length, k); 
-            //printf("DEBUG levenshtein: haystack='%s' (len %zu), needle='%s' (len %zu), k=%zu, result=%d\n", first_read_slice, barcode_pos, b->fw, b->fw_length, k, match_first_fw);
-            if (match_first_fw != -1) {
-                // revcomp(rv)
-                int match_last_fw = levenshtein_distance(last_read_slice, barcode_pos, b->rv_comp, b->rv_length, k);
-                if (match_last_fw != -1) {
-                    b->counter++;
-                    int slice_end = read->len - barcode_pos + match_last_fw - b->rv_length;
-                    if (slice_end <= 0) continue;
-                    if (trim) {
-                        if (!append_read_to_gzip_fastq(b->out_gz, read, match_first_fw, slice_end)) exit(1);
-                    } else {
-                        if (!append_read_to_gzip_fastq(b->out_gz, read, 0, read->len)) exit(1);
-                    }
-                }
-            } else {
-                // rv ------ revcomp(fw)
-                int match_first_rv = levenshtein_distance(first_read_slice, barcode_pos, b->rv, b->rv_length, k);
-                if (match_first_rv != -1) {
-                    // revcomp(fw)
-                    int match_last_rv = levenshtein_distance(last_read_slice, barcode_pos, b->fw_comp, b->fw_length, k);
-                    if (match_last_rv != -1) {
-                        b->counter++;
-                        int slice_end = read->len - barcode_pos + match_last_rv - b->fw_length;
-                        if (slice_end <= 0) continue;
-                        if (trim) {
-                            if (!append_read_to_gzip_fastq(b->out_gz, read, match_first_rv, slice_end)) exit(1);
-                        } else {
-                            if (!append_read_to_gzip_fastq(b->out_gz, read, 0, read->len)) exit(1);
-                        }
-                    }
-                }
+        slice_hits_search(&h->rv, &sets->rv, &h->first, k);
+        slice_hits_search(&h->rv_comp, &sets->rv_comp, &h->last, k);
+    }
+    return match_read(read, sets, h, windows, trim, barcode_schema);
+}
+
+// Assigns every read of one chunk to a bin. Each read slice is scanned once
+// per orientation for all distinct barcode sequences at the same time; the
+// row with the lowest distance, then the one closest to the read ends, takes
+// the read.
+void process_reads(void *arg) 
+{
+    Thread_Data *td = (Thread_Data *)arg;
+    Barcode_Sets *sets = td->sets;
+    size_t n = td->barcodes->count;
+
+    Read_Hits h;
+    if (!read_hits_init(&h, sets)) {
+        nob_log(NOB_ERROR, "Failed to allocate match buffer");
+        exit(1);
+    }
+
+    for (size_t i = td->start; i < td->end; i++) {
+        Read *read = &td->reads->items[i];
+        if (td->tags) {
+            size_t value_len;
+            const char *value = header_tag(read->comment, read->comment_len, td->tags->key, td->tags->key_len, &value_len);
+            int barcode = value ? tag_table_lookup(&td->tags->table, value, value_len) : -1;
+            if (barcode >= 0) {
+                add_match(&td->matches[barcode], i, 0, (int)read->len);
+                continue;
+            }
+            if (!td->tags->verify) {
+                add_match(&td->matches[n + (barcode == TAG_SHARED ? BIN_AMBIGUOUS : BIN_UNCLASSIFIED)], i, 0, (int)read->len);
+                continue;
             }
         }
+        if (read->first_slice == NULL) {
+            add_match(&td->matches[n + BIN_UNCLASSIFIED], i, 0, (int)read->len);
+            continue;
+        }
+        Best_Hit best = search_read(read, sets, &h, td->windows, td->k, td->trim, td->barcode_schema);
+        if (best.barcode == -1) {
+            add_match(&td->matches[n + BIN_UNCLASSIFIED], i, 0, (int)read->len);
+        } else if (best.tied || best.barcode == PAIR_SHARED) {
+            add_match(&td->matches[n + BIN_AMBIGUOUS], i, 0, (int)read->len);
+        } else {
+            add_match(&td->matches[best.barcode], i, best.hit.start, best.hit.end);
+        }
     }
+    read_hits_free(&h);
+    latch_done(td->latch);
     free(td);
 }
 
+// Writes the reads of one bin in chunk order, keeping the output order
+// identical to the input order. Records are formatted into an output buffer
+// borrowed for the duration of the job; there is one per pool thread.
+void write_barcode(void *arg)
+{
+    Write_Data *wd = (Write_Data *)arg;
+    Barcode *b = wd->barcode;
+    Nob_String_Builder *buf = batch_queue_pop(wd->out_buffers);
+
+    for (size_t c = 0; c < wd->n_chunks; c++) {
+        Matches *matches = &wd->chunk_matches[c * wd->n_bins + wd->bin];
+        b->counter += matches->hits;
+        for (size_t i = 0; i < matches->count; i++) {
+            Match *match = &matches->items[i];
+            Read *read = &wd->reads->items[match->read_idx];
+            if (!append_read_to_gzip_fastq(b->out, buf, read, match->start, match->end)) exit(1);
+        }
+        matches->count = 0;
+        matches->hits = 0;
+    }
+    if (!flush_fastq_buffer(b->out, buf)) exit(1);
+    batch_queue_push(wd->out_buffers, buf);
+    latch_done(wd->latch);
+    free(wd);
+}
+
+static Input_Range *next_input(Reader *r)
+{
+    Input_Range *input = NULL;
+    pthread_mutex_lock(&r->mutex);
+    if (r->next_input < r->inputs->count) input = &r->inputs->items[r->next_input++];
+    pthread_mutex_unlock(&r->mutex);
+    return input;
+}
+
+#define REPORT_INTERVAL (1000 * 10)
+
+// Counts one input read and reports progress. Returns false for reads too
+// short to hold both barcode windows, which go to the unclassified bin
+// without being searched.
+static bool count_read(Reader *r, size_t len, size_t *reads_shorter_than_p)
+{
+    size_t counter = __atomic_add_fetch(&r->counter, 1, __ATOMIC_RELAXED);
+    if (counter % REPORT_INTERVAL == 0) {
+        fprintf(stderr, "\rProcessed: %zu reads", counter);
+        fflush(stderr);
+    }
+    if (!windows_fit(r->windows, len)) {
+        (*reads_shorter_than_p)++;
+        return false;
+    }
+    return true;
+}
+
+// Sets the barcode windows of the last read of the batch, or leaves them
+// NULL for a read too short to search, and hands the batch on once it is
+// full.
+static Mux_Batch *finish_read(Reader *r, Mux_Batch *mb, bool searchable)
+{
+    Read *read = &mb->batch.reads.items[mb->batch.reads.count - 1];
+    if (searchable) windows_slice(r->windows, read);
+    else read->first_slice = read->last_slice = NULL;
+
+    if (mb->batch.reads.count >= READ_BUFFER) {
+        batch_queue_push(r->full_batches, mb);
+        mb = batch_queue_pop(r->free_batches);
+    }
+    return mb;
+}
+
+// Parse stage: each reader thread parses the input ranges it claims into free
+// batches and passes them on, so decompression and parsing overlap with
+// matching and writing. Compressed inputs are copied into the batch arena;
+// mapped ones are added as views without copying.
+void *read_batches(void *arg)
+{
+    Reader *r = (Reader *)arg;
+    Mux_Batch *mb = batch_queue_pop(r->free_batches);
+    size_t reads_shorter_than_p = 0;
+    Input_Range *input;
+
+    while ((input = next_input(r)) != NULL) {
+        if (input->map) {
+            const char *pos = input->map->data + input->start;
+            const char *end = input->map->data + input->end;
+            Read read;
+            int ret;
+            while ((ret = fastq_next_record(&pos, end, &read)) > 0) {
+                bool searchable = count_read(r, read.len, &reads_shorter_than_p);
+                nob_da_append(&mb->batch.reads, read);
+                mb = finish_read(r, mb, searchable);
+            }
+            // like kseq, a malformed record such as a cut-off tail ends the input
+            if (ret < 0) {
+                nob_log(NOB_WARNING, "Malformed FASTQ record in %s at byte %zu, skipping up to byte %zu", input->path, (size_t)(pos - input->map->data), input->end);
+            }
+            continue;
+        }
+
+        Gz_Reader *fp = gz_reader_open(input->path, r->inflate_pool);
+        if (!fp) {
+            nob_log(NOB_ERROR, "Failed to open %s, exiting", input->path);
+            exit(1);
+        }
+        kseq_t *seq = kseq_init(fp);
+
+        while (kseq_read(seq) >= 0) { 
+            bool searchable = count_read(r, seq->seq.l, &reads_shorter_than_p);
+            const char *comment = r->keep_comments ? seq->comment.s : NULL;
+            if (!read_batch_push(&mb->batch, seq->name.s, seq->name.l, comment, seq->comment.l, seq->seq.s, seq->qual.s, seq->seq.l)) {
+                nob_log(NOB_ERROR, "Failed to allocate read buffer");
+                exit(1);
+            }
+            mb = finish_read(r, mb, searchable);
+        }
+        kseq_destroy(seq);
+        gz_reader_close(fp);
+    }
+
+    // left over reads in the last batch
+    if (mb->batch.reads.count > 0) batch_queue_push(r->full_batches, mb);
+    else batch_queue_push(r->free_batches, mb);
+
+    pthread_mutex_lock(&r->mutex);
+    r->reads_shorter_than_p += reads_shorter_than_p;
+    bool last = --r->active == 0;
+    pthread_mutex_unlock(&r->mutex);
+    if (last) batch_queue_close(r->full_batches);
+    return NULL;
+}
+
+// Maps plain FASTQ inputs and cuts big ones into ranges for parallel parsing.
+// Compressed inputs, and plain ones that aren't four-line FASTQ, stay whole and
+// go through zlib and kseq.
+static bool plan_input_ranges(Nob_File_Paths *inputs, Mapped_File *maps, size_t num_threads, Input_Ranges *ranges)
+{
+    size_t *bounds = malloc((num_threads + 1) * sizeof(size_t));
+    if (!bounds) return false;
+    for (size_t i = 0; i < inputs->count; i++) {
+        const char *path = inputs->items[i];
+        Mapped_File *map = &maps[i];
+        Read first;
+        const char *pos = NULL;
+        if (is_gzip_file(path) || !mapped_file_open(map, path)) {
+            Input_Range range = { .path = path };
+            nob_da_append(ranges, range);
+            continue;
+        }
+        pos = map->data;
+        if (fastq_next_record(&pos, map->data + map->size, &first) < 0) {
+            mapped_file_close(map);
+            Input_Range range = { .path = path };
+            nob_da_append(ranges, range);
+            continue;
+        }
+
+        size_t n = map->size / MAPPED_RANGE_MIN;
+        if (n > num_threads) n = num_threads;
+        if (n == 0) n = 1;
+        size_t m = fastq_split_ranges(map->data, map->size, n, bounds);
+        for (size_t j = 0; j < m; j++) {
+            Input_Range range = { .path = path, .map = map, .start = bounds[j], .end = bounds[j + 1] };
+            nob_da_append(ranges, range);
+        }
+    }
+    free(bounds);
+    return true;
+}
+
+// Match stage: fans the batch out to the pool in read chunks and waits for
+// this batch only, so writes of the previous batch keep running.
+static bool match_batch(threadpool thpool, Mux_Batch *mb, Barcodes *barcodes, Barcode_Sets *sets, const Header_Tags *tags, size_t n_chunks, size_t n_bins, Windows windows, size_t k, bool trim, int barcode_schema)
+{
+    Reads *reads = &mb->batch.reads;
+    size_t per_chunk = reads->count / n_chunks;
+    size_t rest = reads->count % n_chunks;
+    size_t end = 0;
+
+    latch_add(&mb->latch, n_chunks);
+    for (size_t c = 0; c < n_chunks; c++) {
+        Thread_Data *td = malloc(sizeof(Thread_Data));
+        if (!td) {
+            nob_log(NOB_ERROR, "Failed to allocate thread data");
+            return false;
+        }
+        td->barcodes = barcodes;
+        td->sets = sets;
+        td->tags = tags;
+        td->reads = reads;
+        td->start = end;
+        end += per_chunk + (c < rest ? 1 : 0);
+        td->end = end;
+        td->matches = &mb->chunk_matches[c * n_bins];
+        td->n_bins = n_bins;
+        td->windows = windows;
+        td->k = k;
+        td->trim = trim;
+        td->barcode_schema = barcode_schema;
+        td->latch = &mb->latch;
+        thpool_add_work(thpool, process_reads, (void *)td);
+    }
+    latch_wait(&mb->latch);
+    return true;
+}
+
+// Write stage: one pool job per output bin, then the batch is recycled.
+void *write_batches(void *arg)
+{
+    Writer *w = (Writer *)arg;
+    Mux_Batch *mb;
+
+    while ((mb = batch_queue_pop(w->write_batches)) != NULL) {
+        latch_add(&mb->latch, w->n_bins);
+        for (size_t b = 0; b < w->n_bins; b++) {
+            Write_Data *wd = malloc(sizeof(Write_Data));
+            if (!wd) {
+                nob_log(NOB_ERROR, "Failed to allocate thread data");
+                exit(1);
+            }
+            wd->barcode = w->bins[b];
+            wd->reads = &mb->batch.reads;
+            wd->chunk_matches = mb->chunk_matches;
+            wd->n_chunks = w->n_chunks;
+            wd->bin = b;
+            wd->n_bins = w->n_bins;
+            wd->out_buffers = w->out_buffers;
+            wd->latch = &mb->latch;
+            thpool_add_work(w->thpool, write_barcode, (void *)wd);
+        }
+        latch_wait(&mb->latch);
+        read_batch_reset(&mb->batch);
+        batch_queue_push(w->free_batches, mb);
+    }
+    return NULL;
+}
+
+// Smallest window that holds the given share of the hits, where hist[w]
+// counts the hits that need a window of w bases.
+static size_t window_covering(const size_t *hist, size_t max, size_t total, double coverage)
+{
+    size_t needed = (size_t)ceil(coverage * (double)total);
+    size_t covered = 0;
+    for (size_t w = 0; w <= max; w++) {
+        covered += hist[w];
+        if (covered >= needed) return w;
+    }
+    return max;
+}
+
+// Largest window start that leaves out at most the uncovered share of the
+// hits, where hist[s] counts the hits with s bases before their barcode.
+static size_t window_start_covering(const size_t *hist, size_t max, size_t total, double coverage)
+{
+    size_t allowed = total - (size_t)ceil(coverage * (double)total);
+    size_t skipped = 0;
+    for (size_t s = 0; s <= max; s++) {
+        if (skipped + hist[s] > allowed) return s;
+        skipped += hist[s];
+    }
+    return max;
+}
+
+// Calibration phase: matches the first n_reads reads of the inputs with the
+// configured windows and moves the start and the end of each window in to the
+// span that covers CALIBRATION_COVERAGE of the hits there, so an adapter
+// before the barcodes is no longer scanned. sample_reads and the hit counts go
+// to the log.
+static bool calibrate_windows(Nob_File_Paths *inputs, Barcode_Sets *sets, size_t n_reads, size_t k, int barcode_schema, Windows *windows, size_t *sample_reads, size_t *first_hits, size_t *last_hits)
+{
+    size_t max = windows->first_end > windows->last_end ? windows->first_end : windows->last_end;
+    size_t *first_hist = calloc(max + 1, sizeof(size_t));
+    size_t *last_hist = calloc(max + 1, sizeof(size_t));
+    size_t *first_skip_hist = calloc(max + 1, sizeof(size_t));
+    size_t *last_skip_hist = calloc(max + 1, sizeof(size_t));
+    Read_Hits h;
+    if (!first_hist || !last_hist || !first_skip_hist || !last_skip_hist || !read_hits_init(&h, sets)) return false;
+
+    *sample_reads = *first_hits = *last_hits = 0;
+    for (size_t i = 0; i < inputs->count && *sample_reads < n_reads; i++) {
+        Gz_Reader *fp = gz_reader_open(inputs->items[i], NULL);
+        if (!fp) {
+            nob_log(NOB_ERROR, "Failed to open %s", inputs->items[i]);
+            return false;
+        }
+        kseq_t *seq = kseq_init(fp);
+        while (*sample_reads < n_reads && kseq_read(seq) >= 0) {
+            if (!windows_fit(*windows, seq->seq.l)) continue;
+            (*sample_reads)++;
+            Read read = { .seq = seq->seq.s, .len = seq->seq.l };
+            windows_slice(*windows, &read);
+            Best_Hit best = search_read(&read, sets, &h, *windows, k, false, barcode_schema);
+            if (best.barcode == -1 || best.tied) continue;
+            if (best.hit.first_span >= 0) {
+                first_hist[(size_t)best.hit.first_span > max ? max : (size_t)best.hit.first_span]++;
+                first_skip_hist[(size_t)best.hit.first_skip > max ? max : (size_t)best.hit.first_skip]++;
+                (*first_hits)++;
+            }
+            if (best.hit.last_span >= 0) {
+                last_hist[(size_t)best.hit.last_span > max ? max : (size_t)best.hit.last_span]++;
+                last_skip_hist[(size_t)best.hit.last_skip > max ? max : (size_t)best.hit.last_skip]++;
+                (*last_hits)++;
+            }
+        }
+        kseq_destroy(seq);
+        gz_reader_close(fp);
+    }
+
+    // every hit skips fewer bases than it spans, and the two shares overlap,
+    // so the windows can't become empty
+    if (*first_hits >= CALIBRATION_MIN_HITS) {
+        windows->first_start = window_start_covering(first_skip_hist, windows->first_end, *first_hits, CALIBRATION_COVERAGE);
+        windows->first_end = window_covering(first_hist, windows->first_end, *first_hits, CALIBRATION_COVERAGE);
+    }
+    if (*last_hits >= CALIBRATION_MIN_HITS) {
+        windows->last_start = window_start_covering(last_skip_hist, windows->last_end, *last_hits, CALIBRATION_COVERAGE);
+        windows->last_end = window_covering(last_hist, windows->last_end, *last_hits, CALIBRATION_COVERAGE);
+    }
+    read_hits_free(&h);
+    free(first_hist);
+    free(last_hist);
+    free(first_skip_hist);
+    free(last_skip_hist);
+    return true;
+}
+
+// Parses a window option of the form START:END. An empty option gives the
+// default window [0, barcode_pos).
+static bool parse_window(const char *arg, size_t barcode_pos, size_t *start, size_t *end)
+{
+    *start = 0;
+    *end = barcode_pos;
+    if (*arg == '\0') return true;
+
+    const char *colon = strchr(arg, ':');
+    if (!colon || colon == arg || colon[1] == '\0') return false;
+    char *start_str = strndup(arg, colon - arg);
+    bool digits = start_str && must_be_digit(start_str) && must_be_digit(colon + 1);
+    if (digits) {
+        *start = strtoull(start_str, NULL, 10);
+        *end = strtoull(colon + 1, NULL, 10);
+    }
+    free(start_str);
+    return digits && *start < *end;
+}
+
 int main(int argc, char **argv) {    
 
     // flag.h arguments
     char **barcode_file = flag_str("b", "", "Path to barcode file (MANDATORY)");
-    char **fastq_file = flag_str("f", "", "Path to fastq file (MANDATORY)");
+    char **fastq_file = flag_str("f", "", "Path to fastq file, folder or comma-separated list of files (MANDATORY)");
     char **out_folder = flag_str("o", "", "Name of output folder (MANDATORY)");
     size_t *barcode_pos = flag_size("p", 50, "Position of barcode");
+    char **window_5 = flag_str("w5", "", "5' barcode window START:END counted from the 5' end, 0:p when empty");
+    char **window_3 = flag_str("w3", "", "3' barcode window START:END counted back from the 3' end, 0:p when empty");
     size_t *k = flag_size("k", 0, "Number of mismatches allowed");
+    size_t *calibrate = flag_size("c", 0, "Narrow the barcode windows using the first N reads (0: off)");
     bool *trim = flag_bool("t", false, "Trim reads from adapters or not");
     size_t *num_threads = flag_size("j", 1, "Number of threads to use");
+    char **tag = flag_str("tag", "", "Classify reads by the header field with this key, e.g. barcode or barcode=, without aligning (off when empty)");
+    bool *verify = flag_bool("verify", false, "With -tag, search reads whose field names no single barcode by sequence");
+    bool *gzi = flag_bool("gzi", false, "Write a .gzi block index next to each output file");
     bool *help = flag_bool("help", false, "Print this help to stdout and exit with 0");
     bool *version = flag_bool("v", false, "Print the current version");
 
@@ -174,14 +967,27 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-	if (*k >= 4) {
-		nob_log(NOB_ERROR, "k cannot be larger than 3");
-		return 1;
-	}
+    if (*num_threads == 0) {
+        nob_log(NOB_ERROR, "Number of threads must be at least 1");
+        return 1;
+    }
+
+    Windows windows;
+    if (!parse_window(*window_5, *barcode_pos, &windows.first_start, &windows.first_end)) {
+        nob_log(NOB_ERROR, "Invalid 5' window %s, expected START:END with START < END", *window_5);
+        return 1;
+    }
+    if (!parse_window(*window_3, *barcode_pos, &windows.last_start, &windows.last_end)) {
+        nob_log(NOB_ERROR, "Invalid 3' window %s, expected START:END with START < END", *window_3);
+        return 1;
+    }
 
     nob_log(NOB_INFO, "Running nanomux");
-    nob_log(NOB_INFO, "Barcode position: 0 -> %zu", *barcode_pos);
+    nob_log(NOB_INFO, "Barcode windows: 5' [%zu, %zu), 3' [%zu, %zu)", windows.first_start, windows.first_end, windows.last_start, windows.last_end);
     nob_log(NOB_INFO, "k: %zu", *k);
+    if (**tag != '\0') {
+        nob_log(NOB_INFO, "Header tag: %s (other reads: %s)", *tag, *verify ? "searched by sequence" : "not searched");
+    }
     const char *trim_option_string = *trim ? "true" : "false";
     nob_log(NOB_INFO, "Trim option: %s", trim_option_string);
     nob_log(NOB_INFO, "threads: %zu", *num_threads);
@@ -193,6 +999,14 @@ int main(int argc, char **argv) {
     }
 
     
+    // Output blocks are compressed on their own pool: the write jobs on the
+    // main pool wait for them.
+    threadpool compress_pool = thpool_init(*num_threads);
+    if (compress_pool == NULL) {
+        printf("ERROR: Could not init threads\n");
+        return 1;
+    }
+
     nob_log(NOB_INFO, "Parsing barcode file %s", *barcode_file);
     
     // ----------------- BARCODES ---------------------------
@@ -201,8 +1015,9 @@ int main(int argc, char **argv) {
     printf("barcode schema: %d\n", barcode_schema);
     Nob_String_Builder sb = {0};
     Barcodes barcodes = {0};
-    if (!parse_barcodes(*barcode_file, &barcodes, &sb, *out_folder)) return 1;
+    if (!parse_barcodes(*barcode_file, &barcodes, &sb, *out_folder, compress_pool, *gzi)) return 1;
     // validate barcodes
+    size_t shortest = SIZE_MAX;
     for (size_t i = 0; i < barcodes.count; i++) {
         Barcode current_bc = barcodes.items[i];
         if (barcode_schema == 2) {
@@ -215,88 +1030,196 @@ int main(int argc, char **argv) {
                 printf("ERROR: Wrong barcode at row: %zu\n", i);
                 return 1;
             }
+        for (size_t e = 0; e < N_EXTRA_BINS; e++) {
+            if (strcmp(current_bc.name, extra_bin_names[e]) == 0) {
+                nob_log(NOB_ERROR, "Barcode name %s is reserved for reads without a single best barcode", current_bc.name);
+                return 1;
+            }
+        }
+        if (current_bc.fw_length < shortest) shortest = current_bc.fw_length;
+        if (barcode_schema == 2 && current_bc.rv_length < shortest) shortest = current_bc.rv_length;
+    }
+    // a barcode of k bases or fewer is found anywhere
+    if (barcodes.count > 0 && *k >= shortest) {
+        nob_log(NOB_ERROR, "k must be smaller than the shortest barcode (%zu nt)", shortest);
+        return 1;
+    }
+
+    Header_Tags header_tags = { .key = *tag, .key_len = strlen(*tag), .verify = *verify };
+    if (header_tags.key_len > 0 && !tag_table_init(&header_tags.table, &barcodes)) {
+        nob_log(NOB_ERROR, "Failed to build the header tag table");
+        return 1;
+    }
+    const Header_Tags *tags = header_tags.key_len > 0 ? &header_tags : NULL;
+    // every read is classified by its tag, so nothing is searched
+    bool searching = !tags || tags->verify;
+
+    // output bins: the barcodes, then the extra bins
+    Barcode extra_bins[N_EXTRA_BINS] = {0};
+    size_t n_bins = barcodes.count + N_EXTRA_BINS;
+    Barcode **bins = malloc(n_bins * sizeof(Barcode *));
+    if (!bins) {
+        nob_log(NOB_ERROR, "Failed to allocate output bins");
+        return 1;
+    }
+    for (size_t i = 0; i < barcodes.count; i++) bins[i] = &barcodes.items[i];
+    for (size_t e = 0; e < N_EXTRA_BINS; e++) {
+        Barcode *bin = &extra_bins[e];
+        bin->name = (char *)extra_bin_names[e];
+        snprintf(bin->out_name, sizeof(bin->out_name), "%s/%s.fq.gz", *out_folder, bin->name);
+        bin->out = bgzf_open(bin->out_name, "ab", compress_pool, *gzi);
+        if (!bin->out) {
+            printf("ERROR: Could not open %s to write to\n", bin->out_name);
+            return 1;
+        }
+        bins[barcodes.count + e] = bin;
     }
     
+    Barcode_Sets sets;
+    if (!barcode_sets_init(&sets, &barcodes, barcode_schema, *k)) {
+        nob_log(NOB_ERROR, "Failed to build barcode match tables");
+        return 1;
+    }
+    nob_log(NOB_INFO, "Matcher kernel: %s", simd_level_name(sets.fw.level));
+    int min_distance = min_pattern_distance(&sets.fw);
+    if (barcode_schema == 2) {
+        int rv_distance = min_pattern_distance(&sets.rv);
+        if (min_distance == -1 || (rv_distance != -1 && rv_distance < min_distance)) min_distance = rv_distance;
+    }
+    if (min_distance != -1) {
+        nob_log(NOB_INFO, "Minimum barcode distance: %d", min_distance);
+        if (2 * *k > (size_t)min_distance) {
+            nob_log(NOB_WARNING, "k = %zu is more than half the minimum barcode distance: reads within k of two barcodes go to ambiguous", *k);
+        }
+    }
+    if (barcode_schema == 2) {
+        nob_log(NOB_INFO, "Distinct barcode sequences: %zu forward, %zu reverse", sets.n_fw, sets.n_rv);
+    }
+    if (sets.fw.seeds.enabled) {
+        nob_log(NOB_INFO, "Seed filter: %zu-mers", sets.fw.seeds.seed_len);
+    } else {
+        nob_log(NOB_INFO, "Seed filter: off (barcodes too short for k)");
+    }
+    if (sets.fw.neighbours.enabled) {
+        nob_log(NOB_INFO, "Neighbourhood table: %zu entries", sets.fw.neighbours.count);
+    } else {
+        nob_log(NOB_INFO, "Neighbourhood table: off");
+    }
+
     // ----------------- THREADS ---------------------------
     threadpool thpool = thpool_init(*num_threads);
     if (thpool == NULL) {
         printf("ERROR: Could not init threads\n");
         return 1;
     }
+    size_t n_chunks = *num_threads * CHUNKS_PER_THREAD;
     
     // ----------------- GO THROUGH READS ---------------------------
-    gzFile fp = gzopen(*fastq_file, "r"); 
-    if (!fp) return 1;
-    kseq_t *seq = kseq_init(fp);
-    Reads reads = {0};
-    int l;
-    size_t counter = 0;
-    size_t reads_shorter_than_p = 0;
-
-#define REPORT_INTERVAL (1000 * 10)
+    Nob_File_Paths inputs = {0};
+    if (!collect_fastq_inputs(*fastq_file, &inputs)) return 1;
 
-    while ((l = kseq_read(seq)) >= 0) { 
-        counter++;
-        if (counter % REPORT_INTERVAL == 0) {
-            fprintf(stderr, "\rProcessed: %zu reads", counter);
-            fflush(stderr);
+    size_t sample_reads = 0, first_hits = 0, last_hits = 0;
+    if (*calibrate > 0 && !searching) {
+        nob_log(NOB_WARNING, "Calibration skipped: reads are classified by header tag only");
+    } else if (*calibrate > 0) {
+        nob_log(NOB_INFO, "Calibrating barcode windows on %zu reads", *calibrate);
+        if (!calibrate_windows(&inputs, &sets, *calibrate, *k, barcode_schema, &windows, &sample_reads, &first_hits, &last_hits)) {
+            nob_log(NOB_ERROR, "Calibration failed");
+            return 1;
         }
-        if (seq->seq.l <= *barcode_pos) {
-            reads_shorter_than_p++;
-            continue;
+        nob_log(NOB_INFO, "Calibrated windows: 5' [%zu, %zu) (%zu hits), 3' [%zu, %zu) (%zu hits)",
+                windows.first_start, windows.first_end, first_hits, windows.last_start, windows.last_end, last_hits);
+        if (first_hits < CALIBRATION_MIN_HITS || last_hits < CALIBRATION_MIN_HITS) {
+            nob_log(NOB_WARNING, "Fewer than %d calibration hits at an end, its window is left as given", CALIBRATION_MIN_HITS);
         }
-        Read read = {0};
-        read.seq = strdup(seq->seq.s);
-        read.name = strdup(seq->name.s);
-        read.qual = strdup(seq->qual.s);
-        read.len = seq->seq.l;
-        read.first_slice = strndup(seq->seq.s, *barcode_pos);
-        read.last_slice = strdup(seq->seq.s + seq->seq.l - *barcode_pos);
-        
-        nob_da_append(&reads, read);
-        
-        // ----------------- TRIGGER THREADS AND PROCESSING ---------------------------
-        if (reads.count >= READ_BUFFER) {
-            for (size_t i = 0; i < barcodes.count; i++) {
-                Thread_Data *td = malloc(sizeof(Thread_Data));
-                if (!td) {
-                    nob_log(NOB_ERROR, "Failed to allocate thread data");
-                    return 1;
-                }
-                td->barcode = &barcodes.items[i];
-                td->reads = &reads;
-                td->barcode_pos = *barcode_pos;
-                td->k = *k;
-                td->trim = *trim;
-                td->barcode_schema = barcode_schema;
-                thpool_add_work(thpool, process_barcode, (void *)td);
-            }
-            thpool_wait(thpool);
-            
-            // Clean up reads
-            for (size_t i = 0; i < reads.count; i++) free_read(reads.items[i]);
-            reads.count = 0;
+    }
+    Mapped_File *maps = calloc(inputs.count, sizeof(Mapped_File));
+    Input_Ranges ranges = {0};
+    if (!maps || !plan_input_ranges(&inputs, maps, *num_threads, &ranges)) {
+        nob_log(NOB_ERROR, "Failed to plan input reading");
+        return 1;
+    }
+    size_t n_readers = ranges.count < *num_threads ? ranges.count : *num_threads;
+    nob_log(NOB_INFO, "Reading %zu input file(s) in %zu range(s) with %zu reader(s)", inputs.count, ranges.count, n_readers);
+
+    // readers -> full_queue -> matcher -> write_queue -> writer -> free_queue
+    // Every reader holds one batch while filling it, so each extra reader
+    // gets an extra batch.
+    size_t n_batches = PIPELINE_DEPTH + n_readers - 1;
+    Mux_Batch *mux_batches = calloc(n_batches, sizeof(Mux_Batch));
+    Batch_Queue free_queue, full_queue, write_queue;
+    if (!mux_batches ||
+        !batch_queue_init(&free_queue, n_batches) ||
+        !batch_queue_init(&full_queue, n_batches) ||
+        !batch_queue_init(&write_queue, n_batches)) {
+        nob_log(NOB_ERROR, "Failed to allocate batch queues");
+        return 1;
+    }
+    Nob_String_Builder *out_buffers = calloc(*num_threads, sizeof(Nob_String_Builder));
+    Batch_Queue out_buffer_queue;
+    if (!out_buffers || !batch_queue_init(&out_buffer_queue, *num_threads)) {
+        nob_log(NOB_ERROR, "Failed to allocate output buffers");
+        return 1;
+    }
+    for (size_t i = 0; i < *num_threads; i++) batch_queue_push(&out_buffer_queue, &out_buffers[i]);
+    for (size_t i = 0; i < n_batches; i++) {
+        mux_batches[i].chunk_matches = calloc(n_chunks * n_bins, sizeof(Matches));
+        if (!mux_batches[i].chunk_matches) {
+            nob_log(NOB_ERROR, "Failed to allocate match buffers");
+            return 1;
         }
+        latch_init(&mux_batches[i].latch);
+        batch_queue_push(&free_queue, &mux_batches[i]);
     }
 
-    // PROCESS LEFT OVER READS IN BUFFER
-    if (reads.count > 0) {
-        for (size_t i = 0; i < barcodes.count; i++) {
-            Thread_Data *td = malloc(sizeof(Thread_Data));
-            if (!td) {
-                nob_log(NOB_ERROR, "Failed to allocate thread data");
-                return 1;
-            }
-            td->barcode = &barcodes.items[i];
-            td->reads = &reads;
-            td->barcode_pos = *barcode_pos;
-            td->k = *k;
-            td->trim = *trim;
-            td->barcode_schema = barcode_schema;
-            thpool_add_work(thpool, process_barcode, (void *)td);
+    Reader reader = {
+        .inputs = &ranges,
+        .inflate_pool = thpool,
+        .active = n_readers,
+        .free_batches = &free_queue,
+        .full_batches = &full_queue,
+        .windows = windows,
+        .keep_comments = tags != NULL,
+    };
+    Writer writer = {
+        .thpool = thpool,
+        .bins = bins,
+        .n_bins = n_bins,
+        .write_batches = &write_queue,
+        .free_batches = &free_queue,
+        .out_buffers = &out_buffer_queue,
+        .n_chunks = n_chunks,
+    };
+    pthread_mutex_init(&reader.mutex, NULL);
+    pthread_t *reader_threads = malloc(n_readers * sizeof(pthread_t));
+    pthread_t writer_thread;
+    if (!reader_threads) {
+        nob_log(NOB_ERROR, "Failed to allocate reader threads");
+        return 1;
+    }
+    for (size_t i = 0; i < n_readers; i++) {
+        if (pthread_create(&reader_threads[i], NULL, read_batches, &reader) != 0) {
+            nob_log(NOB_ERROR, "Could not start pipeline threads");
+            return 1;
         }
-        thpool_wait(thpool);
     }
+    if (pthread_create(&writer_thread, NULL, write_batches, &writer) != 0) {
+        nob_log(NOB_ERROR, "Could not start pipeline threads");
+        return 1;
+    }
+
+    Mux_Batch *mb;
+    while ((mb = batch_queue_pop(&full_queue)) != NULL) {
+        if (!match_batch(thpool, mb, &barcodes, &sets, tags, n_chunks, n_bins, windows, *k, *trim, barcode_schema)) return 1;
+        batch_queue_push(&write_queue, mb);
+    }
+    batch_queue_close(&write_queue);
+    for (size_t i = 0; i < n_readers; i++) pthread_join(reader_threads[i], NULL);
+    pthread_join(writer_thread, NULL);
+    free(reader_threads);
+    pthread_mutex_destroy(&reader.mutex);
+    size_t counter = reader.counter;
+    size_t reads_shorter_than_p = reader.reads_shorter_than_p;
     
     
     // ----------------- LOG TO STDOUT, SUMMARY, MATCHES AND REMOVE EMPTY FILES---------------------------
@@ -307,6 +1230,14 @@ int main(int argc, char **argv) {
     fprintf(LOG_FILE, "Barcodes: %s\n", *barcode_file);
     fprintf(LOG_FILE, "Fastq: %s\n", *fastq_file);
     fprintf(LOG_FILE, "Barcode position: %zu\n", *barcode_pos);
+    if (tags) {
+        fprintf(LOG_FILE, "Header tag: %s\n", *tag);
+        fprintf(LOG_FILE, "Verify by sequence: %i\n", *verify);
+    }
+    if (*calibrate > 0 && searching) {
+        fprintf(LOG_FILE, "Calibration: %zu reads, %zu 5' hits, %zu 3' hits\n", sample_reads, first_hits, last_hits);
+    }
+    fprintf(LOG_FILE, "Barcode windows: 5' [%zu, %zu), 3' [%zu, %zu)\n", windows.first_start, windows.first_end, windows.last_start, windows.last_end);
     fprintf(LOG_FILE, "k: %i\n", (int) *k);
     fprintf(LOG_FILE, "Output folder: %s\n", *out_folder);
     fprintf(LOG_FILE, "Trim option: %i\n", *trim);
@@ -316,30 +1247,55 @@ int main(int argc, char **argv) {
     fprintf(LOG_FILE, "Reads shorter than p: %zu reads\n", reads_shorter_than_p);
     
     fprintf(S_FILE, "barcode,matches\n");
-    for (size_t i = 0; i < barcodes.count; i++) {
-        size_t bc_count = barcodes.items[i].counter;
-        char *bc_name = barcodes.items[i].name;
+    for (size_t i = 0; i < n_bins; i++) {
+        size_t bc_count = bins[i]->counter;
+        char *bc_name = bins[i]->name;
         fprintf(S_FILE, "%s,%zu\n", bc_name, bc_count);
         printf("%s: %zu\n", bc_name, bc_count);
+        if (!close_gz_files(bins[i])) {
+            nob_log(NOB_ERROR, "Failed to finish %s", bins[i]->out_name);
+            return 1;
+        }
         // remove file if empty
         if (bc_count == 0) {
-            char *bc_file = barcodes.items[i].out_name;
+            char *bc_file = bins[i]->out_name;
             nob_delete_file(bc_file);
+            if (*gzi) nob_delete_file(nob_temp_sprintf("%s.gzi", bc_file));
         }
     }
     
     // ----------------- CLEAN-UP ---------------------------
     thpool_destroy(thpool);
-    for (size_t i = 0; i < reads.count; i++) free_read(reads.items[i]);
+    thpool_destroy(compress_pool);
     for (size_t i = 0; i < barcodes.count; i++) {
-        gzclose(barcodes.items[i].out_gz);
         free_barcode(&barcodes.items[i]);
     }
+    barcode_sets_free(&sets);
+    if (tags) tag_table_free(&header_tags.table);
+    for (size_t i = 0; i < n_batches; i++) {
+        for (size_t j = 0; j < n_chunks * n_bins; j++) nob_da_free(mux_batches[i].chunk_matches[j]);
+        free(mux_batches[i].chunk_matches);
+        latch_destroy(&mux_batches[i].latch);
+        read_batch_free(&mux_batches[i].batch);
+    }
+    free(mux_batches);
+    free(bins);
+    batch_queue_destroy(&free_queue);
+    batch_queue_destroy(&full_queue);
+    batch_queue_destroy(&write_queue);
+    batch_queue_destroy(&out_buffer_queue);
+    for (size_t i = 0; i < *num_threads; i++) nob_sb_free(out_buffers[i]);
+    free(out_buffers);
     nob_da_free(barcodes);
-    nob_da_free(reads);
     fclose(S_FILE);
     fclose(LOG_FILE);
-    gzclose(fp);
+    for (size_t i = 0; i < inputs.count; i++) {
+        mapped_file_close(&maps[i]);
+        free((char *)inputs.items[i]);
+    }
+    free(maps);
+    nob_da_free(ranges);
+    nob_da_free(inputs);
     
     printf("\n");
     nob_log(NOB_INFO, "nanomux done!\n");
@@ -12,7 +12,7 @@
 #include "thpool.h"
 #include <string.h>
 
-KSEQ_INIT(gzFile, gzread)
+KSEQ_INIT(Gz_Reader *, gz_reader_read)
 #define READ_BUFFER (2 * 1000)
 
 typedef struct {
@@ -22,6 +22,7 @@ typedef struct {
 
     const char *in_file;
     const char *out_file;
+    Mapped_File map;
 
     size_t raw_reads;
     size_t too_short;
@@ -36,15 +37,64 @@ typedef struct {
     size_t capacity;
 } Fastq_Files;
 
+// One buffered batch of the pipeline. Each filter chunk formats its passing
+// reads into its own entry of chunk_out, which holds one entry per thread and
+// which the writer appends in chunk order; n_chunks is set by the filter
+// stage. last_of_file tells the writer to close the output after this batch.
+typedef struct {
+    Read_Batch batch;
+    Nob_String_Builder *chunk_out;
+    size_t n_chunks;
+    Fastq_File *f;
+    bool last_of_file;
+    Latch latch;
+} Trim_Batch;
+
 typedef struct {
     Fastq_File *f;
     Reads *reads;
+    Nob_String_Builder *out;
     size_t start;
     size_t end;
-    gzFile out_file;
-    pthread_mutex_t *print_mutex;
+    pthread_mutex_t *stats_mutex;
+    Latch *latch;
 } Thread_Data;
 
+// Hands out the input files to the lanes, each taking the next unclaimed one.
+// active counts the lanes that haven't finished their last batch yet.
+typedef struct {
+    Fastq_Files *fastq_files;
+    size_t next;
+    size_t active;
+    pthread_mutex_t mutex;
+} File_Cursor;
+
+typedef struct {
+    File_Cursor *files;
+    threadpool inflate_pool;
+    Batch_Queue *free_batches;
+    Batch_Queue *full_batches;
+} Reader;
+
+typedef struct {
+    threadpool compress_pool;
+    bool write_index;
+    Batch_Queue *write_batches;
+    Batch_Queue *free_batches;
+} Writer;
+
+// One reader -> filter -> writer pipeline working through whole files. Lanes
+// run side by side and share the filter and compression pools, whose
+// num_threads are split among the lanes still active.
+typedef struct {
+    threadpool thpool;
+    threadpool compress_pool;
+    bool write_index;
+    File_Cursor *files;
+    size_t num_threads;
+    pthread_mutex_t *stats_mutex;
+} Lane;
+
 
 bool parse_input( const char *input, const char *output, Fastq_Files *fastq_files, size_t min_qual, size_t min_len, size_t max_len ) {
     Nob_File_Type type = nob_get_file_type(input);
@@ -151,27 +201,283 @@ void parse_fastq(void *arg)
 
         if (average_qual(cur_read.qual, cur_read.len) < (double)f->min_qual) { local_bad++; continue; }
 
-        pthread_mutex_lock(td->print_mutex);
-            if (!append_read_to_gzip_fastq(td->out_file, &cur_read, 0, cur_read.len)) {
-                // If append fails, unlock then exit
-                pthread_mutex_unlock(td->print_mutex);
-                exit(1);
-            }
-            f->qualified_reads++;
-        pthread_mutex_unlock(td->print_mutex);
+        fastq_append_record(td->out, cur_read.name, cur_read.name_len, cur_read.seq, cur_read.qual, cur_read.len);
         local_passed++;
     }
 
-    pthread_mutex_lock(td->print_mutex);
+    pthread_mutex_lock(td->stats_mutex);
         f->raw_reads += local_raw;
         f->too_short += local_short;
         f->too_long += local_long;
         f->too_bad += local_bad;
-    pthread_mutex_unlock(td->print_mutex);
+        f->qualified_reads += local_passed;
+    pthread_mutex_unlock(td->stats_mutex);
 
+    latch_done(td->latch);
     free(td);
 }
 
+static Fastq_File *next_file(File_Cursor *c)
+{
+    Fastq_File *f = NULL;
+    pthread_mutex_lock(&c->mutex);
+    if (c->next < c->fastq_files->count) f = &c->fastq_files->items[c->next++];
+    pthread_mutex_unlock(&c->mutex);
+    return f;
+}
+
+// Adds the reads of a mapped plain FASTQ file to the batches as views into the
+// mapping. A malformed record, such as the cut-off tail of a file still being
+// written, ends the file there with a warning, like kseq. Returns the batch
+// being filled.
+static Trim_Batch *read_mapped_file(Reader *r, Trim_Batch *tb, Fastq_File *f)
+{
+    const char *pos = f->map.data;
+    const char *end = f->map.data + f->map.size;
+    Read read;
+    int ret;
+    while ((ret = fastq_next_record(&pos, end, &read)) > 0) {
+        nob_da_append(&tb->batch.reads, read);
+        if (tb->batch.reads.count >= READ_BUFFER) {
+            tb->f = f;
+            tb->last_of_file = false;
+            batch_queue_push(r->full_batches, tb);
+            tb = batch_queue_pop(r->free_batches);
+        }
+    }
+    if (ret < 0) {
+        nob_log(NOB_WARNING, "Malformed FASTQ record in %s at byte %zu, skipping the rest of the file", f->in_file, (size_t)(pos - f->map.data));
+    }
+    return tb;
+}
+
+// Maps f when it is plain four-line FASTQ, so its reads need no copying.
+static bool map_plain_fastq(Fastq_File *f)
+{
+    if (is_gzip_file(f->in_file) || !mapped_file_open(&f->map, f->in_file)) return false;
+    const char *pos = f->map.data;
+    Read first;
+    if (fastq_next_record(&pos, f->map.data + f->map.size, &first) < 0) {
+        mapped_file_close(&f->map);
+        return false;
+    }
+    return true;
+}
+
+// Parse stage: reads the files claimed by this lane in turn into free batches.
+// Each file ends with a batch flagged last_of_file, which may be empty; the
+// writer unmaps mapped files after that batch.
+void *read_batches(void *arg)
+{
+    Reader *r = (Reader *)arg;
+    Trim_Batch *tb = batch_queue_pop(r->free_batches);
+
+    Fastq_File *f;
+    while ((f = next_file(r->files)) != NULL) {
+        if (map_plain_fastq(f)) {
+            tb = read_mapped_file(r, tb, f);
+            tb->f = f;
+            tb->last_of_file = true;
+            batch_queue_push(r->full_batches, tb);
+            tb = batch_queue_pop(r->free_batches);
+            continue;
+        }
+
+        Gz_Reader *in_file = gz_reader_open(f->in_file, r->inflate_pool);
+        if (!in_file) {
+            nob_log(NOB_ERROR, "Failed to open %s file, exiting", f->in_file);
+            exit(1);
+        }
+        kseq_t *seq = kseq_init(in_file); 
+        if (seq == NULL) {
+            nob_log(NOB_ERROR, "Could not initialize %s file, exiting", f->in_file);
+            exit(1);
+        }
+
+        // read loop
+        while (kseq_read(seq) >= 0) { 
+            if (!read_batch_push(&tb->batch, seq->name.s, seq->name.l, NULL, 0, seq->seq.s, seq->qual.s, seq->seq.l)) {
+                nob_log(NOB_ERROR, "Failed to allocate read buffer");
+                exit(1);
+            }
+            if (tb->batch.reads.count >= READ_BUFFER) {
+                tb->f = f;
+                tb->last_of_file = false;
+                batch_queue_push(r->full_batches, tb);
+                tb = batch_queue_pop(r->free_batches);
+            }
+        }
+
+        // ------------- IF ANY READS LEFT -------------------
+        tb->f = f;
+        tb->last_of_file = true;
+        batch_queue_push(r->full_batches, tb);
+        tb = batch_queue_pop(r->free_batches);
+
+        kseq_destroy(seq); 
+        gz_reader_close(in_file); 
+    }
+
+    batch_queue_push(r->free_batches, tb);
+    batch_queue_close(r->full_batches);
+    return NULL;
+}
+
+// Splits the threads among the lanes still running, so a big file claimed
+// late gets the threads freed by the lanes that have run out of files.
+static size_t lane_chunks(Lane *lane)
+{
+    pthread_mutex_lock(&lane->files->mutex);
+    size_t active = lane->files->active;
+    pthread_mutex_unlock(&lane->files->mutex);
+    size_t n_chunks = active > 0 ? lane->num_threads / active : lane->num_threads;
+    return n_chunks > 0 ? n_chunks : 1;
+}
+
+// Filter stage: splits the batch into num_threads chunks over the pool and waits
+// for this batch only.
+static bool filter_batch(threadpool thpool, Trim_Batch *tb, size_t num_threads, pthread_mutex_t *stats_mutex)
+{
+    Reads *reads = &tb->batch.reads;
+    size_t total = reads->count;
+    size_t per_thread = total / num_threads;
+    size_t rest = total % num_threads;
+    size_t start = 0;
+    size_t end = 0;
+
+    tb->n_chunks = num_threads;
+    latch_add(&tb->latch, num_threads);
+    for (size_t t = 0; t < num_threads; t++) {
+        Thread_Data *td = malloc(sizeof(Thread_Data));
+        if (!td) {
+            nob_log(NOB_ERROR, "Failed to allocate thread data");
+            return false;
+        }
+        
+        start = end;
+        end += per_thread;
+        if (t == (num_threads - 1)) end += rest; 
+
+        td->f = tb->f;
+        td->reads = reads;
+        td->out = &tb->chunk_out[t];
+        td->start = start;
+        td->end = end;
+        td->stats_mutex = stats_mutex;
+        td->latch = &tb->latch;
+        
+        thpool_add_work(thpool, parse_fastq, (void *)td);
+    }
+    latch_wait(&tb->latch);
+    return true;
+}
+
+// Write stage: appends the formatted chunks of each batch in input order.
+void *write_batches(void *arg)
+{
+    Writer *w = (Writer *)arg;
+    Fastq_File *current = NULL;
+    Bgzf_Writer *out_file = NULL;
+    Trim_Batch *tb;
+
+    while ((tb = batch_queue_pop(w->write_batches)) != NULL) {
+        Fastq_File *f = tb->f;
+        if (f != current) {
+            out_file = bgzf_open(f->out_file, "ab", w->compress_pool, w->write_index);
+            if (!out_file) {
+                nob_log(NOB_ERROR, "Failed to open %s file, exiting", f->out_file);
+                exit(1);
+            }
+            current = f;
+        }
+
+        for (size_t c = 0; c < tb->n_chunks; c++) {
+            if (!flush_fastq_buffer(out_file, &tb->chunk_out[c])) exit(1);
+        }
+
+        if (tb->last_of_file) {
+            if (!bgzf_close(out_file)) {
+                nob_log(NOB_ERROR, "Failed to finish %s, exiting", f->out_file);
+                exit(1);
+            }
+            mapped_file_close(&f->map);
+            out_file = NULL;
+            current = NULL;
+        }
+        read_batch_reset(&tb->batch);
+        batch_queue_push(w->free_batches, tb);
+    }
+    return NULL;
+}
+
+
+// Runs one lane until no unclaimed files are left.
+void *run_lane(void *arg)
+{
+    Lane *lane = (Lane *)arg;
+
+    // reader -> full_queue -> filter -> write_queue -> writer -> free_queue
+    Trim_Batch trim_batches[PIPELINE_DEPTH] = {0};
+    Batch_Queue free_queue, full_queue, write_queue;
+    if (!batch_queue_init(&free_queue, PIPELINE_DEPTH) ||
+        !batch_queue_init(&full_queue, PIPELINE_DEPTH) ||
+        !batch_queue_init(&write_queue, PIPELINE_DEPTH)) {
+        nob_log(NOB_ERROR, "Failed to allocate batch queues");
+        exit(1);
+    }
+    for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+        trim_batches[i].chunk_out = calloc(lane->num_threads, sizeof(Nob_String_Builder));
+        if (!trim_batches[i].chunk_out) {
+            nob_log(NOB_ERROR, "Failed to allocate output buffers");
+            exit(1);
+        }
+        latch_init(&trim_batches[i].latch);
+        batch_queue_push(&free_queue, &trim_batches[i]);
+    }
+
+    Reader reader = {
+        .files = lane->files,
+        .inflate_pool = lane->thpool,
+        .free_batches = &free_queue,
+        .full_batches = &full_queue,
+    };
+    Writer writer = {
+        .compress_pool = lane->compress_pool,
+        .write_index = lane->write_index,
+        .write_batches = &write_queue,
+        .free_batches = &free_queue,
+    };
+    pthread_t reader_thread, writer_thread;
+    if (pthread_create(&reader_thread, NULL, read_batches, &reader) != 0 ||
+        pthread_create(&writer_thread, NULL, write_batches, &writer) != 0) {
+        nob_log(NOB_ERROR, "Could not start pipeline threads");
+        exit(1);
+    }
+
+    Trim_Batch *tb;
+    while ((tb = batch_queue_pop(&full_queue)) != NULL) {
+        if (!filter_batch(lane->thpool, tb, lane_chunks(lane), lane->stats_mutex)) exit(1);
+        batch_queue_push(&write_queue, tb);
+    }
+    pthread_mutex_lock(&lane->files->mutex);
+    lane->files->active--;
+    pthread_mutex_unlock(&lane->files->mutex);
+    batch_queue_close(&write_queue);
+    pthread_join(reader_thread, NULL);
+    pthread_join(writer_thread, NULL);
+
+    for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+        read_batch_free(&trim_batches[i].batch);
+        for (size_t c = 0; c < lane->num_threads; c++) nob_sb_free(trim_batches[i].chunk_out[c]);
+        free(trim_batches[i].chunk_out);
+        latch_destroy(&trim_batches[i].latch);
+    }
+    batch_queue_destroy(&free_queue);
+    batch_queue_destroy(&full_queue);
+    batch_queue_destroy(&write_queue);
+    return NULL;
+}
+
 
 int main(int argc, char **argv) {
 
@@ -182,6 +488,7 @@ int main(int argc, char **argv) {
     size_t *max_len = flag_size("R", 1000*1000, "Maximum read length");
     size_t *min_qual = flag_size("q", 0, "Minimum quality");
     size_t *num_threads = flag_size("j", 1, "Number of threads to use");
+    bool *gzi = flag_bool("gzi", false, "Write a .gzi block index next to each output file");
     bool *help = flag_bool("help", false, "Print this help to stdout and exit with 0");
     bool *version = flag_bool("v", false, "Print the current version");
 
@@ -228,117 +535,39 @@ int main(int argc, char **argv) {
     // -------------- GENERATE THREAD POOL ---------------------
     nob_log(NOB_INFO, "Generating threadpool with %zu threads", *num_threads);
     threadpool thpool = thpool_init(*num_threads);
+    threadpool compress_pool = thpool_init(*num_threads);
 
     
-    // -------------- LOOP THROUGH EVERY INPUT FILE ---------------------
-    pthread_mutex_t print_mutex = PTHREAD_MUTEX_INITIALIZER;
-    Reads reads = {0};
-
-    for (size_t fi = 0; fi < fastq_files.count; fi++) {
-        Fastq_File *f = &fastq_files.items[fi];
-        gzFile in_file = gzopen(f->in_file, "r"); 
-        if (!in_file) {
-            nob_log(NOB_ERROR, "Failed to open %s file, exiting", f->in_file);
-            return 1;
-        }
-        gzFile out_file = gzopen(f->out_file, "ab"); 
-        if (!out_file) {
-            nob_log(NOB_ERROR, "Failed to open %s file, exiting", f->out_file);
-            gzclose(in_file);
-            return 1;
-        }
-        kseq_t *seq = kseq_init(in_file); 
-        if (seq == NULL) {
-            nob_log(NOB_ERROR, "Could not initialize %s file, exiting", f->in_file);
-            gzclose(in_file);
-            gzclose(out_file);
+    // -------------- PROCESS FILES IN PARALLEL LANES ---------------------
+    // Many small files are spread over lanes; a few big ones get split into
+    // more chunks per batch instead, and more still once other lanes finish.
+    size_t n_lanes = fastq_files.count < *num_threads ? fastq_files.count : *num_threads;
+    if (n_lanes == 0) n_lanes = 1;
+    File_Cursor cursor = { .fastq_files = &fastq_files, .active = n_lanes };
+    pthread_mutex_init(&cursor.mutex, NULL);
+    pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+    Lane lane = {
+        .thpool = thpool,
+        .compress_pool = compress_pool,
+        .write_index = *gzi,
+        .files = &cursor,
+        .num_threads = *num_threads,
+        .stats_mutex = &stats_mutex,
+    };
+    pthread_t *lane_threads = malloc(n_lanes * sizeof(pthread_t));
+    if (!lane_threads) {
+        nob_log(NOB_ERROR, "Failed to allocate lanes");
+        return 1;
+    }
+    for (size_t i = 0; i < n_lanes; i++) {
+        if (pthread_create(&lane_threads[i], NULL, run_lane, &lane) != 0) {
+            nob_log(NOB_ERROR, "Could not start pipeline threads");
             return 1;
         }
-
-        // read loop
-        while (kseq_read(seq) >= 0) { 
-            Read read = {0};
-            read.seq = strdup(seq->seq.s);
-            read.name = strdup(seq->name.s);
-            read.qual = strdup(seq->qual.s);
-            read.len = (size_t)seq->seq.l;
-            read.first_slice = NULL;
-            read.last_slice = NULL;
-            
-            nob_da_append(&reads, read);
-        
-            if (reads.count >= READ_BUFFER) {
-                size_t total = reads.count;
-                size_t per_thread = total / *num_threads;
-                size_t rest = total % *num_threads;
-                size_t start = 0;
-                size_t end = 0;
-
-                for (size_t t = 0; t < *num_threads; t++) {
-                    Thread_Data *td = malloc(sizeof(Thread_Data));
-                    if (!td) {
-                        nob_log(NOB_ERROR, "Failed to allocate thread data");
-                        return 1;
-                    }
-                    
-                    start = end;
-                    end += per_thread;
-                    if (t == (*num_threads - 1)) end += rest; 
-
-                    td->f = f;
-                    td->reads = &reads;
-                    td->start = start;
-                    td->end = end;
-                    td->out_file = out_file;
-                    td->print_mutex = &print_mutex;
-                    
-            		thpool_add_work(thpool, parse_fastq, (void *)td);
-                }
-            	thpool_wait(thpool);
-
-                // Clean up reads
-                for (size_t ri = 0; ri < reads.count; ri++) free_read(reads.items[ri]);
-                reads.count = 0;
-            }
-        }
-
-        // ------------- IF ANY READS LEFT -------------------
-        if (reads.count > 0) {
-            size_t total = reads.count;
-            size_t per_thread = total / *num_threads;
-            size_t rest = total % *num_threads;
-            size_t start = 0;
-            size_t end = 0;
-            for (size_t t = 0; t < *num_threads; t++) {
-                Thread_Data *td = malloc(sizeof(Thread_Data));
-                if (!td) {
-                    nob_log(NOB_ERROR, "Failed to allocate thread data");
-                    return 1;
-                }
-                
-                start = end;
-                end += per_thread;
-                if (t == (*num_threads - 1)) end += rest;
-                td->f = f;
-                td->reads = &reads;
-                td->start = start;
-                td->end = end;
-                td->out_file = out_file;
-                td->print_mutex = &print_mutex;
-                
-                thpool_add_work(thpool, parse_fastq, (void *)td);
-            }
-            thpool_wait(thpool);
-
-            // Clean up reads
-            for (size_t ri = 0; ri < reads.count; ri++) free_read(reads.items[ri]);
-            reads.count = 0;
-        }
-        
-        kseq_destroy(seq); 
-        gzclose(in_file); 
-        gzclose(out_file); 
     }
+    for (size_t i = 0; i < n_lanes; i++) pthread_join(lane_threads[i], NULL);
+    free(lane_threads);
+    pthread_mutex_destroy(&cursor.mutex);
 
 
     // -------------- PRINT TO SUMMARY FILES ---------------------
@@ -355,7 +584,8 @@ int main(int argc, char **argv) {
     
     // -------------- CLEAN UP ---------------------
 	thpool_destroy(thpool);
-    pthread_mutex_destroy(&print_mutex);
+	thpool_destroy(compress_pool);
+    pthread_mutex_destroy(&stats_mutex);
     nob_da_free(fastq_files);
     fclose(LOG_FILE);
 
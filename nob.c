@@ -11,7 +11,7 @@ int main(int argc, char **argv)
     cmd_append(&cmd, "cc");
     cmd_append(&cmd, "-o", "nanodup");
     cmd_append(&cmd, "nanodup.c", "thpool.c");
-    cmd_append(&cmd, "-lz", "-lpthread", "-O3");
+    cmd_append(&cmd, "-lz", "-lm", "-lpthread", "-O3");
     if (!cmd_run(&cmd)) return 1;
 
     cmd_append(&cmd, "cc");
@@ -29,8 +29,20 @@ int main(int argc, char **argv)
 
     cmd_append(&cmd, "cc");
     cmd_append(&cmd, "-o", "tests/test_unit");
-    cmd_append(&cmd, "tests/test_unit.c");
-    cmd_append(&cmd, "-lz", "-lm");
+    cmd_append(&cmd, "tests/test_unit.c", "thpool.c");
+    cmd_append(&cmd, "-lz", "-lm", "-lpthread");
+    if (!cmd_run(&cmd)) return 1;
+
+    cmd_append(&cmd, "cc");
+    cmd_append(&cmd, "-o", "tests/bench_kseq");
+    cmd_append(&cmd, "tests/bench_kseq.c");
+    cmd_append(&cmd, "-O3");
+    if (!cmd_run(&cmd)) return 1;
+
+    cmd_append(&cmd, "cc");
+    cmd_append(&cmd, "-o", "tests/bench_edit");
+    cmd_append(&cmd, "tests/bench_edit.c", "thpool.c");
+    cmd_append(&cmd, "-lz", "-lm", "-lpthread", "-O3");
     if (!cmd_run(&cmd)) return 1;
 
     return 0;
@@ -0,0 +1,114 @@
+// Microbenchmark for the scalar barcode matchers.
+//
+// Searches random read windows of the -p sizes nanomux uses (50, 100 and 200
+// bases) for one barcode, half of them holding a copy with a few edits, with
+// the full DP (levenshtein_best_dp), Ukkonen's cut-off DP
+// (levenshtein_best_cutoff) and the scalar bit-parallel matcher
+// (bit_parallel_best). All three must agree on every window. Barcodes longer
+// than BIT_PATTERN_MAX only have the two DPs, so the 80 nt rows compare those.
+//
+// Usage: tests/bench_edit [windows]
+
+#define COMMON_IMPLEMENTATION
+#include "../common.h"
+#include "edit_reference.h"
+#include <time.h>
+
+static unsigned state = 1;
+
+static unsigned next_rand(void)
+{
+    state = state * 1103515245u + 12345u;
+    return (state >> 16) & 0x7fff;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef enum { FULL_DP, CUTOFF, BIT_PARALLEL } Matcher;
+
+static double run(Matcher matcher, const char *windows, size_t n, size_t len, const Bit_Pattern *pattern, size_t k, int *ends, int *dists)
+{
+    double start = now();
+    for (size_t w = 0; w < n; w++) {
+        const char *window = windows + w * len;
+        switch (matcher) {
+            case FULL_DP: ends[w] = levenshtein_best_dp(window, len, pattern->needle, pattern->len, k, &dists[w]); break;
+            case CUTOFF: ends[w] = levenshtein_best_cutoff(window, len, pattern->needle, pattern->len, k, &dists[w]); break;
+            case BIT_PARALLEL: ends[w] = bit_parallel_best(window, len, pattern, k, &dists[w]); break;
+        }
+    }
+    return (now() - start) / n * 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 20000;
+    static const size_t window_lens[] = { 50, 100, 200 };
+    static const size_t barcode_lens[] = { 24, 80 };
+    static const size_t ks[] = { 1, 3, 6 };
+
+    int *ends[3], *dists[3];
+    for (int m = 0; m < 3; m++) {
+        ends[m] = malloc(n * sizeof(int));
+        dists[m] = malloc(n * sizeof(int));
+    }
+    char *windows = malloc(n * 200);
+
+    printf("%zu windows per row, ns per window\n", n);
+    printf("%8s %6s %3s %10s %10s %10s %8s\n", "barcode", "window", "k", "full DP", "cut-off", "bit-par", "speedup");
+    for (size_t b = 0; b < sizeof(barcode_lens) / sizeof(barcode_lens[0]); b++) {
+        size_t barcode_len = barcode_lens[b];
+        char barcode[81];
+        for (size_t i = 0; i < barcode_len; i++) barcode[i] = "ACGT"[next_rand() % 4];
+        barcode[barcode_len] = '\0';
+        Bit_Pattern pattern;
+        bit_pattern_init(&pattern, barcode, barcode_len);
+
+        for (size_t wl = 0; wl < sizeof(window_lens) / sizeof(window_lens[0]); wl++) {
+            size_t len = window_lens[wl];
+            if (len < barcode_len) continue;
+            for (size_t w = 0; w < n; w++) {
+                char *window = windows + w * len;
+                for (size_t i = 0; i < len; i++) window[i] = "ACGT"[next_rand() % 4];
+                if (w % 2 == 0) {
+                    size_t offset = next_rand() % (len - barcode_len + 1);
+                    memcpy(window + offset, barcode, barcode_len);
+                    for (size_t e = next_rand() % 3; e > 0; e--) window[offset + next_rand() % barcode_len] = "ACGT"[next_rand() % 4];
+                }
+            }
+
+            for (size_t ki = 0; ki < sizeof(ks) / sizeof(ks[0]); ki++) {
+                size_t k = ks[ki];
+                double full = run(FULL_DP, windows, n, len, &pattern, k, ends[FULL_DP], dists[FULL_DP]);
+                double cutoff = run(CUTOFF, windows, n, len, &pattern, k, ends[CUTOFF], dists[CUTOFF]);
+                bool has_bit_parallel = barcode_len <= BIT_PATTERN_MAX;
+                double bit_parallel = has_bit_parallel ? run(BIT_PARALLEL, windows, n, len, &pattern, k, ends[BIT_PARALLEL], dists[BIT_PARALLEL]) : 0;
+                for (size_t w = 0; w < n; w++) {
+                    bool agree = ends[CUTOFF][w] == ends[FULL_DP][w] && dists[CUTOFF][w] == dists[FULL_DP][w];
+                    if (has_bit_parallel) agree = agree && ends[BIT_PARALLEL][w] == ends[FULL_DP][w] && dists[BIT_PARALLEL][w] == dists[FULL_DP][w];
+                    if (!agree) {
+                        fprintf(stderr, "matchers disagree on window %zu (barcode %zu nt, window %zu, k %zu)\n", w, barcode_len, len, k);
+                        return 1;
+                    }
+                }
+                if (has_bit_parallel) {
+                    printf("%8zu %6zu %3zu %10.0f %10.0f %10.0f %7.1fx\n", barcode_len, len, k, full, cutoff, bit_parallel, full / cutoff);
+                } else {
+                    printf("%8zu %6zu %3zu %10.0f %10.0f %10s %7.1fx\n", barcode_len, len, k, full, cutoff, "-", full / cutoff);
+                }
+            }
+        }
+    }
+
+    for (int m = 0; m < 3; m++) {
+        free(ends[m]);
+        free(dists[m]);
+    }
+    free(windows);
+    return 0;
+}
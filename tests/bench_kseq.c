@@ -0,0 +1,121 @@
+// Microbenchmark for the kseq FASTQ reader.
+//
+// Parses a synthetic FASTQ held in memory twice: once with kseq_read and once
+// with the byte-at-a-time ks_getc loop kseq used before lines were scanned
+// with memchr. Both go through the same kstream buffer, so the difference is
+// the cost of the per-byte path.
+//
+// Usage: tests/bench_kseq [reads] [read_len]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../kseq.h"
+
+typedef struct {
+    const char *data;
+    size_t size;
+    size_t pos;
+} Mem_Stream;
+
+static int mem_read(Mem_Stream *m, void *buf, unsigned len)
+{
+    size_t n = m->size - m->pos;
+    if (n > len) n = len;
+    memcpy(buf, m->data + m->pos, n);
+    m->pos += n;
+    return (int)n;
+}
+
+KSEQ_INIT(Mem_Stream *, mem_read)
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// The sequence and quality loops of kseq_read before the line scanner.
+static int read_bytewise(kseq_t *seq)
+{
+    kstream_t *ks = seq->f;
+    int c;
+    if (seq->last_char == 0) {
+        while ((c = ks_getc(ks)) != -1 && c != '>' && c != '@');
+        if (c == -1) return -1;
+        seq->last_char = c;
+    }
+    seq->comment.l = seq->seq.l = seq->qual.l = 0;
+    if (ks_getuntil(ks, 0, &seq->name, &c) < 0) return -1;
+    if (c != '\n') ks_getuntil(ks, '\n', &seq->comment, 0);
+    while ((c = ks_getc(ks)) != -1 && c != '>' && c != '+' && c != '@') {
+        if (isgraph(c)) {
+            ks_reserve(&seq->seq, seq->seq.l + 2);
+            seq->seq.s[seq->seq.l++] = (char)c;
+        }
+    }
+    if (c == '>' || c == '@') seq->last_char = c;
+    ks_reserve(&seq->seq, seq->seq.l + 1);
+    seq->seq.s[seq->seq.l] = 0;
+    if (c != '+') return seq->seq.l;
+    ks_reserve(&seq->qual, seq->seq.l + 1);
+    while ((c = ks_getc(ks)) != -1 && c != '\n');
+    if (c == -1) return -2;
+    while ((c = ks_getc(ks)) != -1 && seq->qual.l < seq->seq.l)
+        if (c >= 33 && c <= 127) seq->qual.s[seq->qual.l++] = (unsigned char)c;
+    seq->qual.s[seq->qual.l] = 0;
+    seq->last_char = 0;
+    if (seq->seq.l != seq->qual.l) return -2;
+    return seq->seq.l;
+}
+
+static double run(const char *data, size_t size, int bytewise, size_t *bases)
+{
+    Mem_Stream m = { data, size, 0 };
+    kseq_t *seq = kseq_init(&m);
+    double start = now();
+    *bases = 0;
+    int l;
+    while ((l = bytewise ? read_bytewise(seq) : kseq_read(seq)) >= 0) *bases += l;
+    double elapsed = now() - start;
+    kseq_destroy(seq);
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    size_t reads = argc > 1 ? strtoull(argv[1], NULL, 10) : 20000;
+    size_t read_len = argc > 2 ? strtoull(argv[2], NULL, 10) : 5000;
+
+    size_t record = read_len * 2 + 32;
+    char *data = malloc(reads * record);
+    size_t size = 0;
+    unsigned state = 1;
+    for (size_t i = 0; i < reads; i++) {
+        size += sprintf(data + size, "@read%zu runid=bench\n", i);
+        for (size_t j = 0; j < read_len; j++) {
+            state = state * 1103515245u + 12345u;
+            data[size++] = "ACGT"[(state >> 16) & 3];
+        }
+        size += sprintf(data + size, "\n+\n");
+        for (size_t j = 0; j < read_len; j++) data[size++] = (char)('#' + (j % 40));
+        data[size++] = '\n';
+    }
+
+    printf("%zu reads of %zu bp, %.1f MB, buffer %d bytes\n",
+           reads, read_len, size / 1e6, KSEQ_BUFSIZE);
+    size_t bases_old, bases_new;
+    double t_old = run(data, size, 1, &bases_old);
+    double t_new = run(data, size, 0, &bases_new);
+    if (bases_old != bases_new || bases_new != reads * read_len) {
+        fprintf(stderr, "base counts differ: %zu vs %zu\n", bases_old, bases_new);
+        return 1;
+    }
+    printf("bytewise:  %.3fs  %.0f MB/s\n", t_old, size / 1e6 / t_old);
+    printf("kseq_read: %.3fs  %.0f MB/s  (%.1fx)\n", t_new, size / 1e6 / t_new, t_old / t_new);
+
+    free(data);
+    return 0;
+}
@@ -0,0 +1,36 @@
+// Reference matcher for the unit tests and benchmarks. It fills the whole DP
+// matrix and is too slow for nanomux itself. Include after common.h.
+#ifndef EDIT_REFERENCE_H_
+#define EDIT_REFERENCE_H_
+
+// Lowest edit distance of the needle over all end positions, like the last DP
+// row of levenshtein_distance_dp. The reference for levenshtein_best_cutoff.
+static int levenshtein_best_dp(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len, size_t k, int *dist)
+{
+    *dist = -1;
+    if (k > needle_len) return -1;
+
+    size_t dp[needle_len + 1][haystack_len + 1];
+    for (size_t j = 0; j <= haystack_len; j++) dp[0][j] = 0;
+    for (size_t i = 1; i <= needle_len; i++) {
+        dp[i][0] = i;
+        for (size_t j = 1; j <= haystack_len; j++) {
+            if (nt_match(needle[i - 1], haystack[j - 1])) {
+                dp[i][j] = dp[i - 1][j - 1];
+            } else {
+                dp[i][j] = 1 + min_size(dp[i - 1][j], dp[i][j - 1], dp[i - 1][j - 1]);
+            }
+        }
+    }
+
+    int best_end = -1;
+    for (size_t j = needle_len; j <= haystack_len; j++) {
+        if (dp[needle_len][j] <= k && (*dist == -1 || (int)dp[needle_len][j] < *dist)) {
+            *dist = (int)dp[needle_len][j];
+            best_end = (int)j;
+        }
+    }
+    return best_end;
+}
+
+#endif // EDIT_REFERENCE_H_
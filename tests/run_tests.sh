@@ -63,6 +63,26 @@ assert_read_not_in_output() {
     fi
 }
 
+assert_contains() {
+    local desc="$1" needle="$2" haystack="$3"
+    if printf '%s' "$haystack" | grep -qF -- "$needle"; then
+        PASS=$((PASS + 1))
+    else
+        FAIL=$((FAIL + 1))
+        echo "  FAIL: $desc — '$needle' not found"
+    fi
+}
+
+assert_not_contains() {
+    local desc="$1" needle="$2" haystack="$3"
+    if ! printf '%s' "$haystack" | grep -qF -- "$needle"; then
+        PASS=$((PASS + 1))
+    else
+        FAIL=$((FAIL + 1))
+        echo "  FAIL: $desc — '$needle' should not appear"
+    fi
+}
+
 get_match_count() {
     local csv="$1" barcode="$2"
     grep "^${barcode}," "$csv" | cut -d, -f2
@@ -146,22 +166,182 @@ $NANOMUX -b tests/test_barcodes_single.csv -f tests/test_known.fastq -o "$OUT" -
 short_count=$(cat "$TMPDIR/short_msg.txt" | grep -o '[0-9]*' | head -1)
 assert_eq "reads shorter than p" "1" "$short_count"
 
-# ---------- Test 8: Invalid k=4 ----------
-echo "TEST 8: Invalid k=4 rejected"
+# ---------- Test 8: k limited by the barcodes ----------
+echo "TEST 8: k limited by the barcodes"
+# the 12 nt test barcodes are 7 edits apart
 OUT="$TMPDIR/test8"
-if $NANOMUX -b tests/test_barcodes_single.csv -f tests/test_known.fastq -o "$OUT" -p 50 -k 4 -j 1 >/dev/null 2>&1; then
+if $NANOMUX -b tests/test_barcodes_single.csv -f tests/test_known.fastq -o "$OUT" -p 50 -k 12 -j 1 >/dev/null 2>&1; then
     FAIL=$((FAIL + 1))
-    echo "  FAIL: k=4 should return non-zero exit code"
+    echo "  FAIL: k as long as the barcodes should return non-zero exit code"
 else
     PASS=$((PASS + 1))
 fi
 
+OUT="$TMPDIR/test8_k4"
+if log=$($NANOMUX -b tests/test_barcodes_single.csv -f tests/test_known.fastq -o "$OUT" -p 50 -k 4 -j 1 2>&1); then
+    PASS=$((PASS + 1))
+else
+    FAIL=$((FAIL + 1))
+    echo "  FAIL: k=4 should be accepted"
+fi
+assert_contains "minimum barcode distance is logged" "Minimum barcode distance: 7" "$log"
+assert_contains "k=4 warns about the barcode distance" "more than half the minimum barcode distance" "$log"
+assert_read_in_output "k=4 still finds BC_A" "read_a_fw_k0" "$OUT/BC_A.fq.gz"
+
+log=$($NANOMUX -b tests/test_barcodes_single.csv -f tests/test_known.fastq -o "$TMPDIR/test8_k3" -p 50 -k 3 -j 1 2>&1)
+assert_not_contains "k=3 does not warn" "more than half" "$log"
+
 # ---------- Test 9: Reverse orientation in dual mode ----------
 echo "TEST 9: Reverse orientation in dual mode"
 OUT="$TMPDIR/test9"
 $NANOMUX -b tests/test_barcodes_dual.csv -f tests/test_known.fastq -o "$OUT" -p 50 -k 0 -j 1 >/dev/null 2>&1
 assert_read_in_output "read_a_dual_rev matched in dual (rv...fw_comp)" "read_a_dual_rev" "$OUT/BC_A.fq.gz"
 
+# ---------- Test 10: Directory and file-list input ----------
+echo "TEST 10: Directory and file-list input"
+OUT="$TMPDIR/test10"
+IN="$TMPDIR/test10_in"
+mkdir -p "$IN"
+cp tests/test_known.fastq "$IN/part1.fastq"
+gzip -c tests/test_known.fastq > "$IN/part2.fastq.gz"
+# a block index written by -gzi is not an input
+printf '\x01\x00\x00\x00\x00\x00\x00\x00' > "$IN/part2.fastq.gz.gzi"
+log=$($NANOMUX -b tests/test_barcodes_single.csv -f "$IN" -o "$OUT" -p 50 -k 0 -j 2 2>&1)
+assert_contains "only the fastq files of a directory are read" "Reading 2 input file(s)" "$log"
+assert_eq "BC_A match count over a directory" "8" "$(get_match_count "$OUT/nanomux_matches.csv" "BC_A")"
+assert_eq "BC_A reads over a directory" "8" "$(count_reads "$OUT/BC_A.fq.gz")"
+
+OUT="$TMPDIR/test10_list"
+$NANOMUX -b tests/test_barcodes_single.csv -f "tests/test_known.fastq,$IN/part2.fastq.gz" -o "$OUT" -p 50 -k 0 -j 1 >/dev/null 2>&1
+assert_eq "BC_B match count over a file list" "2" "$(get_match_count "$OUT/nanomux_matches.csv" "BC_B")"
+
+# ---------- Test 11: Unclassified and ambiguous bins ----------
+echo "TEST 11: Unclassified and ambiguous bins"
+OUT="$TMPDIR/test11"
+$NANOMUX -b tests/test_barcodes_single.csv -f tests/test_known.fastq -o "$OUT" -p 50 -k 0 -j 1 >/dev/null 2>&1
+assert_eq "unclassified count" "3" "$(get_match_count "$OUT/nanomux_matches.csv" "unclassified")"
+assert_read_in_output "read_nomatch unclassified" "read_nomatch" "$OUT/unclassified.fq.gz"
+assert_read_in_output "read_short unclassified" "read_short" "$OUT/unclassified.fq.gz"
+assert_file_not_exists "ambiguous.fq.gz deleted when empty" "$OUT/ambiguous.fq.gz"
+total=$(( $(count_reads "$OUT/BC_A.fq.gz") + $(count_reads "$OUT/BC_B.fq.gz") + $(count_reads "$OUT/unclassified.fq.gz") ))
+assert_eq "every read written once" "8" "$total"
+
+# Two barcodes with the same sequence tie on every read carrying it.
+printf 'name,forward\nBC_A,AACCGGTTAACC\nBC_A2,AACCGGTTAACC\nBC_B,AAAGGGCCCAAA\n' > "$TMPDIR/tied.csv"
+OUT="$TMPDIR/test11_tied"
+$NANOMUX -b "$TMPDIR/tied.csv" -f tests/test_known.fastq -o "$OUT" -p 50 -k 0 -j 1 >/dev/null 2>&1
+assert_eq "tied barcodes get no reads" "0" "$(get_match_count "$OUT/nanomux_matches.csv" "BC_A")"
+assert_eq "ambiguous count" "4" "$(get_match_count "$OUT/nanomux_matches.csv" "ambiguous")"
+assert_read_in_output "read_a_fw_k0 ambiguous" "read_a_fw_k0" "$OUT/ambiguous.fq.gz"
+assert_eq "BC_B unaffected by the tie" "1" "$(get_match_count "$OUT/nanomux_matches.csv" "BC_B")"
+
+# ---------- Test 12: Combinatorial dual barcodes ----------
+echo "TEST 12: Combinatorial dual barcodes"
+printf 'name,forward,reverse\nAA,AACCGGTTAACC,TTGGCCAATTGG\nAB,AACCGGTTAACC,TTTCCCGGGTTT\nBA,AAAGGGCCCAAA,TTGGCCAATTGG\nBB,AAAGGGCCCAAA,TTTCCCGGGTTT\n' > "$TMPDIR/plate.csv"
+OUT="$TMPDIR/test12"
+$NANOMUX -b "$TMPDIR/plate.csv" -f tests/test_known.fastq -o "$OUT" -p 50 -k 0 -j 1 >/dev/null 2>&1
+assert_eq "AA pair count" "2" "$(get_match_count "$OUT/nanomux_matches.csv" "AA")"
+assert_eq "AB pair count" "0" "$(get_match_count "$OUT/nanomux_matches.csv" "AB")"
+assert_eq "BA pair count" "0" "$(get_match_count "$OUT/nanomux_matches.csv" "BA")"
+assert_read_in_output "read_a_dual_rev in AA" "read_a_dual_rev" "$OUT/AA.fq.gz"
+
+# ---------- Test 13: Barcode window calibration ----------
+echo "TEST 13: Barcode window calibration"
+OUT="$TMPDIR/test13"
+for i in $(seq 40); do cat tests/test_known.fastq; done > "$TMPDIR/repeated.fastq"
+$NANOMUX -b tests/test_barcodes_single.csv -f "$TMPDIR/repeated.fastq" -o "$OUT" -p 50 -k 0 -j 1 -c 1000 >/dev/null 2>&1
+# 120 5' hits lie at bases 10-22; 80 3' hits are too few, so that end keeps -p
+assert_eq "calibrated windows logged" "Barcode windows: 5' [10, 22), 3' [0, 50)" "$(grep "^Barcode windows" "$OUT/nanomux.log")"
+assert_eq "BC_A count with calibrated windows" "160" "$(get_match_count "$OUT/nanomux_matches.csv" "BC_A")"
+
+# 120 3' hits lie 28-40 bases from the 3' end, so that window starts at 28 too
+OUT="$TMPDIR/test13_3prime"
+for i in $(seq 60); do cat tests/test_known.fastq; done > "$TMPDIR/repeated60.fastq"
+$NANOMUX -b tests/test_barcodes_single.csv -f "$TMPDIR/repeated60.fastq" -o "$OUT" -p 50 -k 0 -j 1 -c 1000 >/dev/null 2>&1
+assert_eq "calibrated window starts logged" "Barcode windows: 5' [10, 22), 3' [28, 40)" "$(grep "^Barcode windows" "$OUT/nanomux.log")"
+assert_eq "BC_A count with calibrated starts" "240" "$(get_match_count "$OUT/nanomux_matches.csv" "BC_A")"
+
+# ---------- Test 14: Separate 5' and 3' windows ----------
+echo "TEST 14: Separate 5' and 3' windows"
+# BC_A sits at bases 10-22 of read_a_fw_k0 and 28-40 from the 3' end of read_a_3prime
+OUT="$TMPDIR/test14"
+$NANOMUX -b tests/test_barcodes_single.csv -f tests/test_known.fastq -o "$OUT" -p 50 -k 0 -j 1 -t -w5 10:30 -w3 20:45 >/dev/null 2>&1
+trimmed_len=$(gunzip -c "$OUT/BC_A.fq.gz" | awk '/^@read_a_fw_k0/{getline; print length($0)}')
+assert_eq "5' window offset keeps trim position" "178" "$trimmed_len"
+trimmed_3prime=$(gunzip -c "$OUT/BC_A.fq.gz" | awk '/^@read_a_3prime/{getline; print length($0)}')
+assert_eq "3' window offset keeps trim position" "160" "$trimmed_3prime"
+
+OUT="$TMPDIR/test14_narrow"
+$NANOMUX -b tests/test_barcodes_single.csv -f tests/test_known.fastq -o "$OUT" -p 50 -k 0 -j 1 -w5 12:50 -w3 30:50 >/dev/null 2>&1
+assert_read_in_output "read_a_fw_k0 outside the 5' window" "read_a_fw_k0" "$OUT/unclassified.fq.gz"
+assert_read_in_output "read_a_3prime outside the 3' window" "read_a_3prime" "$OUT/unclassified.fq.gz"
+
+if $NANOMUX -b tests/test_barcodes_single.csv -f tests/test_known.fastq -o "$TMPDIR/test14_bad" -w5 30:10 >/dev/null 2>&1; then
+    FAIL=$((FAIL + 1))
+    echo "  FAIL: an empty window should return non-zero exit code"
+else
+    PASS=$((PASS + 1))
+fi
+
+# ---------- Test 15: IUPAC barcodes ----------
+echo "TEST 15: IUPAC barcodes"
+# BC_A is AACCGGTTAACC; N and R cover its GG, Y does not
+printf "name,forward\nBC_N,AACCNNNNAACC\nBC_R,AACCRRTTAACC\n" > "$TMPDIR/iupac.csv"
+OUT="$TMPDIR/test15"
+$NANOMUX -b "$TMPDIR/iupac.csv" -f tests/test_known.fastq -o "$OUT" -p 50 -k 0 -j 1 >/dev/null 2>&1
+assert_read_in_output "N spacer and R both match, so the read is ambiguous" "read_a_fw_k0" "$OUT/ambiguous.fq.gz"
+
+printf "name,forward\nBC_R,AACCRRTTAACC\nBC_Y,AACCYYTTAACC\n" > "$TMPDIR/iupac2.csv"
+OUT="$TMPDIR/test15_ry"
+$NANOMUX -b "$TMPDIR/iupac2.csv" -f tests/test_known.fastq -o "$OUT" -p 50 -k 0 -j 1 >/dev/null 2>&1
+assert_read_in_output "R matches G" "read_a_fw_k0" "$OUT/BC_R.fq.gz"
+assert_read_in_output "R matches G on the reverse strand" "read_a_3prime" "$OUT/BC_R.fq.gz"
+y_reads=0
+[ -f "$OUT/BC_Y.fq.gz" ] && y_reads=$(gunzip -c "$OUT/BC_Y.fq.gz" | wc -l | tr -d ' ')
+assert_eq "Y does not match G" "0" "$y_reads"
+
+# ---------- Test 16: header tags ----------
+echo "TEST 16: Header tags"
+# read_a_fw_k0 holds BC_A but is tagged BC_B: the tag wins without alignment
+sed -e 's/^@read_a_fw_k0$/@read_a_fw_k0 runid=1 barcode=BC_B/' \
+    -e 's/^@read_b_fw_k0$/@read_b_fw_k0 barcode=unclassified/' \
+    -e 's/^@read_short$/@read_short\tbarcode=BC_A/' tests/test_known.fastq > "$TMPDIR/tagged.fastq"
+OUT="$TMPDIR/test16"
+$NANOMUX -b tests/test_barcodes_single.csv -f "$TMPDIR/tagged.fastq" -o "$OUT" -p 50 -k 0 -j 2 -tag barcode= >/dev/null 2>&1
+assert_read_in_output "tag overrides the sequence" "read_a_fw_k0" "$OUT/BC_B.fq.gz"
+assert_read_in_output "short reads are classified by tag" "read_short" "$OUT/BC_A.fq.gz"
+assert_read_in_output "unknown tag value is unclassified" "read_b_fw_k0" "$OUT/unclassified.fq.gz"
+assert_read_in_output "untagged read is not searched" "read_a_3prime" "$OUT/unclassified.fq.gz"
+
+gzip -c "$TMPDIR/tagged.fastq" > "$TMPDIR/tagged.fastq.gz"
+OUT="$TMPDIR/test16_verify"
+$NANOMUX -b tests/test_barcodes_single.csv -f "$TMPDIR/tagged.fastq.gz" -o "$OUT" -p 50 -k 0 -j 2 -tag barcode= -verify >/dev/null 2>&1
+assert_read_in_output "tag overrides the sequence in gzip input" "read_a_fw_k0" "$OUT/BC_B.fq.gz"
+assert_read_in_output "unknown tag value is searched with -verify" "read_b_fw_k0" "$OUT/BC_B.fq.gz"
+assert_read_in_output "untagged read is searched with -verify" "read_a_3prime" "$OUT/BC_A.fq.gz"
+
+# the key may leave out its '='
+OUT="$TMPDIR/test16_bare"
+$NANOMUX -b tests/test_barcodes_single.csv -f "$TMPDIR/tagged.fastq" -o "$OUT" -p 50 -k 0 -j 1 -tag barcode >/dev/null 2>&1
+assert_read_in_output "bare key finds the tag" "read_a_fw_k0" "$OUT/BC_B.fq.gz"
+
+# ---------- Test 17: Truncated plain FASTQ ----------
+echo "TEST 17: Truncated plain FASTQ"
+# a file still being written ends in the middle of read_short
+head -c -30 tests/test_known.fastq > "$TMPDIR/truncated.fastq"
+OUT="$TMPDIR/test17"
+rc=0
+$NANOMUX -b tests/test_barcodes_single.csv -f "$TMPDIR/truncated.fastq" -o "$OUT" -p 50 -k 1 -j 2 >/dev/null 2>&1 || rc=$?
+assert_eq "nanomux keeps going after a truncated record" "0" "$rc"
+assert_eq "complete reads are demultiplexed" "5" "$(count_reads "$OUT/BC_A.fq.gz")"
+assert_eq "the truncated read_short is dropped" "1" "$(count_reads "$OUT/unclassified.fq.gz")"
+
+OUT="$TMPDIR/test17_trim"
+rc=0
+./nanotrim -f "$TMPDIR/truncated.fastq" -o "$OUT" -j 2 >/dev/null 2>&1 || rc=$?
+assert_eq "nanotrim keeps going after a truncated record" "0" "$rc"
+assert_eq "nanotrim writes the complete reads" "7" "$(count_reads "$OUT/truncated.fastq.filtered")"
+
 # ---------- Summary ----------
 echo ""
 echo "=== Integration Tests: $PASS passed, $FAIL failed ==="
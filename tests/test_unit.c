@@ -1,5 +1,6 @@
 #define COMMON_IMPLEMENTATION
 #include "../common.h"
+#include "edit_reference.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -28,6 +29,10 @@ void test_complement(void) {
     ASSERT(complement('G') == 'C', "G -> C");
     ASSERT(complement('N') == 'N', "N -> N");
     ASSERT(complement('X') == 'N', "X -> N (unknown)");
+    ASSERT(complement('R') == 'Y' && complement('Y') == 'R' && complement('K') == 'M' && complement('M') == 'K', "R <-> Y, K <-> M");
+    ASSERT(complement('S') == 'S' && complement('W') == 'W' && complement('n') == 'N', "S, W and N complement to themselves");
+    ASSERT(complement('B') == 'V' && complement('D') == 'H' && complement('H') == 'D' && complement('V') == 'B', "B <-> V, D <-> H");
+    ASSERT(complement('U') == 'A', "U -> A");
 }
 
 // ---- complement_sequence ----
@@ -94,6 +99,657 @@ void test_levenshtein_distance(void) {
     ASSERT(result == -1, "k > needle_len returns -1");
 }
 
+// ---- bit_parallel_distance ----
+static unsigned int test_rng = 12345;
+
+static unsigned int next_rand(void) {
+    test_rng = test_rng * 1103515245u + 12345u;
+    return (test_rng >> 16) & 0x7fff;
+}
+
+static void random_sequence(char *dest, size_t len, const char *alphabet, size_t alphabet_len) {
+    for (size_t i = 0; i < len; i++) dest[i] = alphabet[next_rand() % alphabet_len];
+    dest[len] = '\0';
+}
+
+void test_bit_parallel_distance(void) {
+    TEST("bit_parallel_distance");
+
+    Bit_Pattern pattern;
+    bit_pattern_init(&pattern, "AACCGGTTAACC", 12);
+    ASSERT(bit_parallel_distance("NNNNNNNNNNAACCGGTTAACCNNNNN", 26, &pattern, 0) == 22, "exact match at offset 10 returns 22");
+    ASSERT(bit_parallel_distance("AACCGTTTAACCNNNNNN", 18, &pattern, 1) == 12, "1 mismatch accepted at k=1");
+    ASSERT(bit_parallel_distance("AACCGTTTAACCNNNNNN", 18, &pattern, 0) == -1, "1 mismatch rejected at k=0");
+    ASSERT(bit_parallel_distance("AACCGGTT", 8, &pattern, 3) == -1, "haystack shorter than needle returns -1");
+
+    // Equivalence with the full DP on random inputs, including mutated copies
+    // of the needle so that matches actually occur.
+    char needle[80];
+    char haystack[256];
+    size_t mismatches = 0;
+    size_t matches = 0;
+    for (size_t iter = 0; iter < 20000; iter++) {
+        size_t needle_len = 1 + next_rand() % 70;
+        size_t haystack_len = next_rand() % 200;
+        size_t k = next_rand() % 5;
+        random_sequence(needle, needle_len, "ACGT", 4);
+        random_sequence(haystack, haystack_len, "ACGTN", 5);
+        if (haystack_len > needle_len && next_rand() % 2 == 0) {
+            size_t offset = next_rand() % (haystack_len - needle_len + 1);
+            memcpy(haystack + offset, needle, needle_len);
+            for (size_t e = next_rand() % 4; e > 0; e--) {
+                haystack[offset + next_rand() % needle_len] = "ACGT"[next_rand() % 4];
+            }
+        }
+
+        int expected = levenshtein_distance_dp(haystack, haystack_len, needle, needle_len, k);
+        int actual = levenshtein_distance(haystack, haystack_len, needle, needle_len, k);
+        if (expected != actual) mismatches++;
+        if (expected != -1) matches++;
+    }
+    ASSERT(matches > 1000, "random equivalence inputs contain matches");
+    ASSERT(mismatches == 0, "bit-parallel matcher agrees with DP on 20000 random inputs");
+
+    int dist;
+    ASSERT(bit_parallel_best("AACCGTTTAACCNNAACCGGTTAACCNN", 28, &pattern, 1, &dist) == 26 && dist == 0, "best hit prefers a later exact match");
+    ASSERT(bit_parallel_best("AACCGTTTAACCNNAACCGTTTAACCNN", 28, &pattern, 1, &dist) == 12 && dist == 1, "equal hits resolve to the first end");
+    ASSERT(bit_parallel_best("AACCGTTTAACCNN", 14, &pattern, 0, &dist) == -1 && dist == -1, "no hit within k gives -1");
+
+    size_t best_mismatches = 0;
+    for (size_t iter = 0; iter < 5000; iter++) {
+        size_t needle_len = 1 + next_rand() % 70;
+        size_t haystack_len = next_rand() % 200;
+        size_t k = next_rand() % 5;
+        random_sequence(needle, needle_len, "ACGT", 4);
+        random_sequence(haystack, haystack_len, "ACGTN", 5);
+        if (haystack_len > needle_len) {
+            size_t offset = next_rand() % (haystack_len - needle_len + 1);
+            memcpy(haystack + offset, needle, needle_len);
+            for (size_t e = next_rand() % 4; e > 0; e--) {
+                haystack[offset + next_rand() % needle_len] = "ACGT"[next_rand() % 4];
+            }
+        }
+        Bit_Pattern p;
+        bit_pattern_init(&p, needle, needle_len);
+        int expected_dist, actual_dist;
+        int expected = levenshtein_best_dp(haystack, haystack_len, needle, needle_len, k, &expected_dist);
+        int actual = bit_parallel_best(haystack, haystack_len, &p, k, &actual_dist);
+        if (expected != actual || expected_dist != actual_dist) best_mismatches++;
+    }
+    ASSERT(best_mismatches == 0, "best-hit matcher agrees with DP on 5000 random inputs");
+}
+
+// ---- packed_seq ----
+void test_packed_seq(void) {
+    TEST("packed_seq");
+
+    ASSERT(nt_is_base('A') && nt_is_base('c') && nt_is_base('G') && nt_is_base('t'), "ACGT are bases in either case");
+    ASSERT(!nt_is_base('N') && !nt_is_base('R') && !nt_is_base('-') && !nt_is_base('\0'), "other bytes are not bases");
+    ASSERT(nt_code('A') == 0 && nt_code('C') == 1 && nt_code('T') == 2 && nt_code('G') == 3, "codes come from the ASCII bits");
+    ASSERT((nt_code('A') ^ 2) == nt_code('T') && (nt_code('C') ^ 2) == nt_code('G'), "complement is code ^ 2");
+    ASSERT(nt_match('a', 'A') && nt_match('A', 'a') && !nt_match('A', 'C'), "nt_match ignores case");
+    ASSERT(nt_match('N', 'G') && nt_match('R', 'a') && nt_match('y', 'T') && !nt_match('R', 'C'), "IUPAC pattern bases match what they stand for");
+    ASSERT(!nt_match('N', 'N') && !nt_match('-', 'A'), "read N and non-IUPAC pattern bytes match nothing");
+    ASSERT(nt_first_non_iupac("ACGTRYSWKMBDHVNU", 16) == 0 && nt_first_non_iupac("ACG0T", 5) == '0', "nt_first_non_iupac");
+
+    // Packing, unpacking and reverse complements on every length around the
+    // vector and word boundaries, against the scalar definitions.
+    Packed_Seq packed = {0}, revcomp = {0};
+    char seq[200], back[201], expected[201];
+    size_t failures = 0;
+    for (size_t len = 0; len < 200; len++) {
+        random_sequence(seq, len, "ACGTNacgtR", len % 3 ? 4 : 10);
+        if (!packed_seq_pack(&packed, seq, len) || !packed_seq_revcomp(&packed, &revcomp)) {
+            failures++;
+            continue;
+        }
+        bool lower = false;
+        for (size_t i = 0; i < len; i++) {
+            if (packed_seq_is_n(&packed, i) != !nt_is_base(seq[i])) failures++;
+            else if (nt_is_base(seq[i]) && packed_seq_code(&packed, i) != nt_code(seq[i])) failures++;
+            if (nt_is_base(seq[i]) && (seq[i] & 0x20)) lower = true;
+        }
+        if (packed.has_lower != lower) failures++;
+
+        for (size_t i = 0; i < len; i++) expected[i] = nt_is_base(seq[i]) ? seq[i] & 0xDF : 'N';
+        expected[len] = '\0';
+        packed_seq_unpack(&packed, back);
+        if (strcmp(back, expected) != 0) failures++;
+
+        complement_sequence(expected, seq, len);
+        packed_seq_unpack(&revcomp, back);
+        if (strcmp(back, seq) != 0) failures++;
+    }
+    ASSERT(failures == 0, "packing and reverse complements agree with the scalar definitions");
+
+    Packed_Seq other = {0};
+    packed_seq_pack(&packed, "ACGTTGCAACGTTGCAACGTTGCAACGTTGCAACG", 35);
+    packed_seq_pack(&other, "ACGTTGCAACGTTGCAACGTTGCAACGTTGCAACG", 35);
+    ASSERT(packed_seq_hash(&packed) == packed_seq_hash(&other), "equal sequences hash alike");
+    packed_seq_pack(&other, "ACGTTGCAACGTTGCAACGTTGCAACGTTGCAACC", 35);
+    ASSERT(packed_seq_hash(&packed) != packed_seq_hash(&other), "a changed last base changes the hash");
+    packed_seq_free(&packed);
+    packed_seq_free(&revcomp);
+    packed_seq_free(&other);
+}
+
+// ---- pattern_set_search ----
+static bool same_best_hit(const char *haystack, size_t haystack_len, const Bit_Pattern *pattern, size_t k, int end, int dist) {
+    int expected_dist;
+    int expected = bit_parallel_best(haystack, haystack_len, pattern, k, &expected_dist);
+    return end == expected && dist == expected_dist;
+}
+
+void test_pattern_set_search(void) {
+    TEST("pattern_set_search");
+
+    // 11 patterns: not a multiple of the lane count, one longer than 64 nt
+    enum { N_PATTERNS = 11 };
+    char needles[N_PATTERNS][80];
+    Bit_Pattern patterns[N_PATTERNS];
+    const Bit_Pattern *pattern_ptrs[N_PATTERNS];
+    for (size_t p = 0; p < N_PATTERNS; p++) {
+        size_t len = p == 3 ? 70 : 6 + next_rand() % 40;
+        random_sequence(needles[p], len, "ACGT", 4);
+        bit_pattern_init(&patterns[p], needles[p], len);
+        pattern_ptrs[p] = &patterns[p];
+    }
+
+    Pattern_Set set;
+    ASSERT(pattern_set_init(&set, pattern_ptrs, N_PATTERNS), "pattern set initialises");
+    Simd_Level detected = set.level;
+
+    char haystack[256];
+    Packed_Seq packed = {0};
+    for (int level = SIMD_SCALAR; level <= (int)detected; level++) {
+        set.level = (Simd_Level)level;
+        size_t mismatches = 0;
+        for (size_t iter = 0; iter < 2000; iter++) {
+            size_t haystack_len = next_rand() % 200;
+            size_t k = next_rand() % 5;
+            random_sequence(haystack, haystack_len, "ACGTN", 5);
+            size_t p = next_rand() % N_PATTERNS;
+            if (haystack_len > patterns[p].len) {
+                size_t offset = next_rand() % (haystack_len - patterns[p].len + 1);
+                memcpy(haystack + offset, needles[p], patterns[p].len);
+                haystack[offset + next_rand() % patterns[p].len] = 'A';
+            }
+
+            int ends[N_PATTERNS], dists[N_PATTERNS];
+            packed_seq_pack(&packed, haystack, haystack_len);
+            pattern_set_search(&set, &packed, k, ends, dists);
+            for (size_t q = 0; q < N_PATTERNS; q++) {
+                if (!same_best_hit(haystack, haystack_len, &patterns[q], k, ends[q], dists[q])) mismatches++;
+            }
+        }
+        char msg[64];
+        snprintf(msg, sizeof(msg), "%s kernel agrees with bit_parallel_best", simd_level_name(set.level));
+        ASSERT(mismatches == 0, msg);
+    }
+
+    // With a seed index the filtered search must give the same answers.
+    set.level = detected;
+    ASSERT(pattern_set_build_seed_index(&set, 2), "seed index builds");
+    ASSERT(set.seeds.enabled, "seed index enabled for k=2");
+    size_t seed_mismatches = 0;
+    for (size_t iter = 0; iter < 2000; iter++) {
+        size_t haystack_len = next_rand() % 200;
+        random_sequence(haystack, haystack_len, "ACGTN", 5);
+        size_t p = next_rand() % N_PATTERNS;
+        if (haystack_len > patterns[p].len) {
+            size_t offset = next_rand() % (haystack_len - patterns[p].len + 1);
+            memcpy(haystack + offset, needles[p], patterns[p].len);
+            for (size_t e = next_rand() % 3; e > 0; e--) {
+                haystack[offset + next_rand() % patterns[p].len] = "ACGT"[next_rand() % 4];
+            }
+        }
+
+        int ends[N_PATTERNS], dists[N_PATTERNS];
+        packed_seq_pack(&packed, haystack, haystack_len);
+        pattern_set_search(&set, &packed, 2, ends, dists);
+        for (size_t q = 0; q < N_PATTERNS; q++) {
+            if (!same_best_hit(haystack, haystack_len, &patterns[q], 2, ends[q], dists[q])) seed_mismatches++;
+        }
+    }
+    ASSERT(seed_mismatches == 0, "seed-filtered search agrees with bit_parallel_best");
+
+    // Neighbourhood lookups replace alignment entirely for small k, except on
+    // haystacks with non-ACGT bases.
+    for (size_t k = 0; k <= 2; k++) {
+        ASSERT(pattern_set_build_neighbourhood(&set, k, NEIGHBOURHOOD_MAX_ENTRIES), "neighbourhood builds");
+        ASSERT(set.neighbours.enabled, "neighbourhood enabled");
+        size_t nb_mismatches = 0;
+        for (size_t iter = 0; iter < 2000; iter++) {
+            size_t haystack_len = next_rand() % 120;
+            random_sequence(haystack, haystack_len, iter % 4 == 0 ? "ACGTN" : "ACGT", iter % 4 == 0 ? 5 : 4);
+            size_t p = next_rand() % N_PATTERNS;
+            if (haystack_len > patterns[p].len) {
+                size_t offset = next_rand() % (haystack_len - patterns[p].len + 1);
+                memcpy(haystack + offset, needles[p], patterns[p].len);
+                for (size_t e = next_rand() % 3; e > 0; e--) {
+                    haystack[offset + next_rand() % patterns[p].len] = "ACGT"[next_rand() % 4];
+                }
+            }
+
+            int ends[N_PATTERNS], dists[N_PATTERNS];
+            packed_seq_pack(&packed, haystack, haystack_len);
+            pattern_set_search(&set, &packed, k, ends, dists);
+            for (size_t q = 0; q < N_PATTERNS; q++) {
+                if (!same_best_hit(haystack, haystack_len, &patterns[q], k, ends[q], dists[q])) nb_mismatches++;
+            }
+        }
+        ASSERT(nb_mismatches == 0, "neighbourhood search agrees with bit_parallel_best");
+    }
+    ASSERT(pattern_set_build_neighbourhood(&set, 2, 100), "oversized neighbourhood is not an error");
+    ASSERT(!set.neighbours.enabled, "oversized neighbourhood is disabled");
+    pattern_set_free(&set);
+    packed_seq_free(&packed);
+}
+
+// ---- barcode_distance ----
+void test_barcode_distance(void) {
+    TEST("barcode_distance");
+    ASSERT(barcode_distance("AACCGGTTAACC", 12, "AACCGGTTAACC", 12) == 0, "identical barcodes");
+    ASSERT(barcode_distance("AACCGGTTAACC", 12, "AAAGGGCCCAAA", 12) == 7, "test barcodes are 7 apart");
+    ASSERT(barcode_distance("ACGT", 4, "AGT", 3) == 1, "a deletion counts once");
+    ASSERT(barcode_distance("ACGT", 4, "", 0) == 4, "distance to an empty barcode is the length");
+    ASSERT(barcode_distance("ACNT", 4, "ACGT", 4) == 0 && barcode_distance("ACRT", 4, "ACYT", 4) == 1, "degenerate bases match any shared base");
+}
+
+// ---- IUPAC patterns ----
+// Copies needle into haystack at offset with each degenerate base replaced by
+// one of the bases it stands for.
+static void plant_instance(char *haystack, size_t offset, const char *needle, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned mask = nt_iupac_mask(needle[i]);
+        char base;
+        do base = "ACTG"[next_rand() % 4]; while (!((mask >> nt_code(base)) & 1));
+        haystack[offset + i] = base;
+    }
+}
+
+void test_iupac_patterns(void) {
+    TEST("iupac_patterns");
+
+    Bit_Pattern spacer;
+    bit_pattern_init(&spacer, "AACCNNNNNNGGTT", 14);
+    int dist;
+    ASSERT(bit_parallel_best("TTAACCGATTACGGTTAA", 18, &spacer, 0, &dist) == 16 && dist == 0, "an N spacer matches any bases");
+    ASSERT(bit_parallel_best("TTAACCGANTACGGTTAA", 18, &spacer, 0, &dist) == -1, "but not a read N");
+    Bit_Pattern purine;
+    bit_pattern_init(&purine, "ACRT", 4);
+    ASSERT(bit_parallel_best("ACGT", 4, &purine, 0, &dist) == 4 && bit_parallel_best("ACCT", 4, &purine, 0, &dist) == -1, "R matches G but not C");
+
+    char needle[80];
+    char haystack[256];
+    size_t mismatches = 0;
+    for (size_t iter = 0; iter < 5000; iter++) {
+        size_t needle_len = 1 + next_rand() % 70;
+        size_t haystack_len = next_rand() % 200;
+        size_t k = next_rand() % 5;
+        random_sequence(needle, needle_len, "ACGTACGTRYSWKMBDHVN", 19);
+        random_sequence(haystack, haystack_len, "ACGTN", 5);
+        if (haystack_len > needle_len) {
+            size_t offset = next_rand() % (haystack_len - needle_len + 1);
+            plant_instance(haystack, offset, needle, needle_len);
+            for (size_t e = next_rand() % 4; e > 0; e--) {
+                haystack[offset + next_rand() % needle_len] = "ACGT"[next_rand() % 4];
+            }
+        }
+        Bit_Pattern p;
+        bit_pattern_init(&p, needle, needle_len);
+        int expected_dist, actual_dist;
+        int expected = levenshtein_best_dp(haystack, haystack_len, needle, needle_len, k, &expected_dist);
+        int actual = bit_parallel_best(haystack, haystack_len, &p, k, &actual_dist);
+        if (expected != actual || expected_dist != actual_dist) mismatches++;
+    }
+    ASSERT(mismatches == 0, "IUPAC best-hit matcher agrees with DP on 5000 random inputs");
+
+    // Degenerate barcodes keep the seed filter and the neighbourhood table.
+    enum { N_PATTERNS = 6 };
+    char needles[N_PATTERNS][32];
+    Bit_Pattern patterns[N_PATTERNS];
+    const Bit_Pattern *pattern_ptrs[N_PATTERNS];
+    for (size_t p = 0; p < N_PATTERNS; p++) {
+        random_sequence(needles[p], 24, "ACGT", 4);
+        if (p % 2 == 0) memcpy(needles[p] + 9, "NN", 2);
+        else needles[p][3 + p] = "RYSWKMBDHV"[next_rand() % 10];
+        bit_pattern_init(&patterns[p], needles[p], 24);
+        pattern_ptrs[p] = &patterns[p];
+    }
+    Pattern_Set set;
+    ASSERT(pattern_set_init(&set, pattern_ptrs, N_PATTERNS), "pattern set initialises");
+    ASSERT(pattern_set_build_seed_index(&set, 2), "seed index builds");
+    bool all_seeded = true;
+    for (size_t p = 0; p < N_PATTERNS; p++) all_seeded = all_seeded && !set.seeds.always[p];
+    ASSERT(all_seeded, "degenerate patterns are seeded from their plain stretches");
+
+    Packed_Seq packed = {0};
+    for (size_t k = 0; k <= 2; k++) {
+        ASSERT(pattern_set_build_neighbourhood(&set, k, NEIGHBOURHOOD_MAX_ENTRIES), "neighbourhood builds");
+        ASSERT(set.neighbours.enabled && !set.neighbours.has_always, "degenerate patterns are in the neighbourhood");
+        size_t set_mismatches = 0;
+        for (size_t iter = 0; iter < 2000; iter++) {
+            size_t haystack_len = next_rand() % 120;
+            random_sequence(haystack, haystack_len, iter % 4 == 0 ? "ACGTN" : "ACGT", iter % 4 == 0 ? 5 : 4);
+            size_t p = next_rand() % N_PATTERNS;
+            if (haystack_len > 24) {
+                size_t offset = next_rand() % (haystack_len - 24 + 1);
+                plant_instance(haystack, offset, needles[p], 24);
+                for (size_t e = next_rand() % 3; e > 0; e--) {
+                    haystack[offset + next_rand() % 24] = "ACGT"[next_rand() % 4];
+                }
+            }
+            int ends[N_PATTERNS], dists[N_PATTERNS];
+            packed_seq_pack(&packed, haystack, haystack_len);
+            // the neighbourhood, the seed-filtered aligner and the plain
+            // aligner must all give bit_parallel_best's answer
+            for (int path = 0; path < 3; path++) {
+                set.neighbours.enabled = path == 0;
+                set.seeds.enabled = path == 1;
+                size_t used_k = path == 1 ? set.seeds.k : k;
+                pattern_set_search(&set, &packed, used_k, ends, dists);
+                for (size_t q = 0; q < N_PATTERNS; q++) {
+                    if (!same_best_hit(haystack, haystack_len, &patterns[q], used_k, ends[q], dists[q])) set_mismatches++;
+                }
+            }
+            set.neighbours.enabled = true;
+            set.seeds.enabled = true;
+        }
+        ASSERT(set_mismatches == 0, "IUPAC pattern set search agrees with bit_parallel_best");
+    }
+    pattern_set_free(&set);
+    packed_seq_free(&packed);
+}
+
+// ---- cut-off DP ----
+void test_levenshtein_cutoff(void) {
+    TEST("levenshtein_cutoff");
+
+    int dist;
+    ASSERT(levenshtein_distance_cutoff("NNNNNNNNNNAACCGGTTAACCNNNNN", 26, "AACCGGTTAACC", 12, 0) == 22, "exact match at offset 10 returns 22");
+    ASSERT(levenshtein_best_cutoff("AACCGTTTAACCNNAACCGGTTAACCNN", 28, "AACCGGTTAACC", 12, 1, &dist) == 26 && dist == 0, "best hit prefers a later exact match");
+    ASSERT(levenshtein_best_cutoff("AACCGTTTAACCNN", 14, "AACCGGTTAACC", 12, 0, &dist) == -1 && dist == -1, "no hit within k gives -1");
+    ASSERT(levenshtein_best_cutoff("ACGT", 4, "", 0, 0, &dist) == 0 && dist == 0, "an empty needle matches at 0");
+
+    // Long and degenerate needles with k up to 12, against the full DP.
+    char needle[160];
+    char haystack[320];
+    size_t mismatches = 0;
+    size_t matches = 0;
+    for (size_t iter = 0; iter < 3000; iter++) {
+        size_t needle_len = 1 + next_rand() % 150;
+        size_t haystack_len = next_rand() % 300;
+        size_t k = next_rand() % 13;
+        random_sequence(needle, needle_len, iter % 3 ? "ACGT" : "ACGTACGTRYN", iter % 3 ? 4 : 11);
+        random_sequence(haystack, haystack_len, "ACGTN", 5);
+        if (haystack_len > needle_len && next_rand() % 4 != 0) {
+            size_t offset = next_rand() % (haystack_len - needle_len + 1);
+            plant_instance(haystack, offset, needle, needle_len);
+            for (size_t e = next_rand() % 8; e > 0; e--) {
+                haystack[offset + next_rand() % needle_len] = "ACGT"[next_rand() % 4];
+            }
+        }
+
+        int expected_dist, actual_dist;
+        int expected = levenshtein_best_dp(haystack, haystack_len, needle, needle_len, k, &expected_dist);
+        int actual = levenshtein_best_cutoff(haystack, haystack_len, needle, needle_len, k, &actual_dist);
+        if (expected != actual || expected_dist != actual_dist) mismatches++;
+        if (levenshtein_distance_dp(haystack, haystack_len, needle, needle_len, k) !=
+            levenshtein_distance_cutoff(haystack, haystack_len, needle, needle_len, k)) mismatches++;
+        if (expected != -1) matches++;
+    }
+    ASSERT(matches > 1000, "random cut-off inputs contain matches");
+    ASSERT(mismatches == 0, "cut-off DP agrees with the full DP on 3000 random inputs");
+}
+
+// ---- gz_reader ----
+static bool gz_reader_matches(const char *path, threadpool pool, const char *expected, size_t len)
+{
+    Gz_Reader *r = gz_reader_open(path, pool);
+    if (!r) return false;
+    char *back = malloc(len + 1);
+    size_t total = 0;
+    int n;
+    char chunk[777];
+    while ((n = gz_reader_read(r, chunk, sizeof(chunk))) > 0) {
+        if (total + n > len) break;
+        memcpy(back + total, chunk, n);
+        total += n;
+    }
+    gz_reader_close(r);
+    bool ok = n == 0 && total == len && memcmp(back, expected, len) == 0;
+    free(back);
+    return ok;
+}
+
+void test_gz_reader(void) {
+    TEST("gz_reader");
+
+    const char *path = "/tmp/nanosweet_test_gz_reader.gz";
+    size_t len = 5*BGZF_BLOCK_SIZE + 321;
+    char *data = malloc(len);
+    random_sequence(data, len, "ACGT\n", 5);
+    // stored members copy these bytes verbatim, which look like gzip headers
+    for (size_t i = 1000; i + 10 < len; i += 20000) memcpy(data + i, "\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\xff", 10);
+    threadpool pool = thpool_init(2);
+
+    uint8_t header[] = { 0x1f, 0x8b, 8, 2, 0, 0, 0, 0, 0, 3, 0, 0 };
+    uLong crc = crc32(0, header, 10);
+    header[10] = crc & 0xff;
+    header[11] = (crc >> 8) & 0xff;
+    ASSERT(gz_header_plausible(header, sizeof(header), 0), "header with a matching FHCRC");
+    header[10] ^= 1;
+    ASSERT(!gz_header_plausible(header, sizeof(header), 0), "FHCRC mismatch is rejected");
+    header[3] = 0;
+    header[8] = 7;
+    ASSERT(!gz_header_plausible(header, sizeof(header), 0), "unknown XFL is rejected");
+    header[8] = 0;
+    header[3] = 4;
+    header[10] = 6;
+    header[11] = 0;
+    ASSERT(!gz_header_plausible(header, sizeof(header), 0), "FEXTRA past the end is rejected");
+
+    Bgzf_Writer *w = bgzf_open(path, "wb", NULL, false);
+    bgzf_write(w, data, len);
+    bgzf_close(w);
+    ASSERT(gz_reader_matches(path, pool, data, len), "BGZF input inflates in parallel");
+
+    size_t parts[] = {0, 70000, 70001, 200000, len};
+    for (size_t i = 0; i + 1 < sizeof(parts)/sizeof(parts[0]); i++) {
+        gzFile gz = gzopen(path, i == 0 ? "wb0" : "ab0");
+        if (parts[i + 1] > parts[i]) gzwrite(gz, data + parts[i], parts[i + 1] - parts[i]);
+        gzclose(gz);
+    }
+    ASSERT(gz_reader_matches(path, pool, data, len), "multi-member gzip with header-like bytes");
+
+    // a stored single member holds the header-like bytes verbatim
+    gzFile gz = gzopen(path, "wb0");
+    gzwrite(gz, data, len);
+    gzclose(gz);
+    ASSERT(gz_reader_matches(path, pool, data, len), "single-member gzip with header-like bytes");
+    Gz_Reader *r = gz_reader_open(path, pool);
+    char chunk[4096];
+    while (gz_reader_read(r, chunk, sizeof(chunk)) > 0) {}
+    ASSERT(!r->parallel && r->next_candidate == 0, "single member is inflated in place without pool jobs");
+    gz_reader_close(r);
+
+    gz = gzopen(path, "wb");
+    gzwrite(gz, data, len);
+    gzclose(gz);
+    ASSERT(gz_reader_matches(path, pool, data, len), "single-member gzip");
+    ASSERT(gz_reader_matches(path, NULL, data, len), "no pool reads with gzread");
+
+    thpool_destroy(pool);
+    remove(path);
+    free(data);
+}
+
+// ---- fastq_next_record / fastq_split_ranges ----
+void test_fastq_ranges(void) {
+    TEST("fastq_next_record");
+
+    const char *text = "@r1 comment\nACGT\n+\n@@@@\n@r2\r\nAC\r\n+r2\r\n@I\r\n";
+    const char *pos = text;
+    const char *end = text + strlen(text);
+    Read read;
+    ASSERT(fastq_next_record(&pos, end, &read) == 1, "first record parses");
+    ASSERT(read.name_len == 2 && memcmp(read.name, "r1", 2) == 0, "name stops at the comment");
+    ASSERT(read.comment_len == 7 && memcmp(read.comment, "comment", 7) == 0, "comment after the name");
+    ASSERT(read.len == 4 && memcmp(read.seq, "ACGT", 4) == 0 && memcmp(read.qual, "@@@@", 4) == 0, "sequence and quality views");
+    ASSERT(fastq_next_record(&pos, end, &read) == 1, "CRLF record parses");
+    ASSERT(read.len == 2 && memcmp(read.qual, "@I", 2) == 0, "CR is not part of the record");
+    ASSERT(fastq_next_record(&pos, end, &read) == 0, "end of buffer");
+
+    const char *wrapped = "@r1\nACGT\nACGT\n+\nIIIIIIII\n";
+    pos = wrapped;
+    ASSERT(fastq_next_record(&pos, wrapped + strlen(wrapped), &read) == -1, "wrapped record is rejected");
+
+    TEST("fastq_split_ranges");
+    // quality lines starting with '@' must not be taken for record starts
+    Nob_String_Builder sb = {0};
+    size_t n_records = 500;
+    for (size_t i = 0; i < n_records; i++) {
+        char seq[64];
+        size_t len = 10 + next_rand() % 40;
+        random_sequence(seq, len, "ACGT", 4);
+        nob_sb_append_cstr(&sb, nob_temp_sprintf("@read%zu\n", i));
+        nob_sb_append_buf(&sb, seq, len);
+        nob_sb_append_cstr(&sb, "\n+\n");
+        for (size_t j = 0; j < len; j++) nob_da_append(&sb, j % 3 == 0 ? '@' : 'I');
+        nob_da_append(&sb, '\n');
+    }
+    size_t bounds[9];
+    size_t m = fastq_split_ranges(sb.items, sb.count, 8, bounds);
+    ASSERT(m == 8, "buffer split into 8 ranges");
+    size_t parsed = 0;
+    bool in_order = true;
+    for (size_t r = 0; r < m; r++) {
+        pos = sb.items + bounds[r];
+        while (fastq_next_record(&pos, sb.items + bounds[r + 1], &read) == 1) {
+            const char *expected = nob_temp_sprintf("read%zu", parsed);
+            if (read.name_len != strlen(expected) || memcmp(read.name, expected, read.name_len) != 0) in_order = false;
+            parsed++;
+        }
+    }
+    ASSERT(parsed == n_records && in_order, "ranges cover every record exactly once");
+    m = fastq_split_ranges(sb.items, 0, 4, bounds);
+    ASSERT(m == 1 && bounds[1] == 0, "empty buffer gives one empty range");
+    nob_sb_free(sb);
+    nob_temp_reset();
+}
+
+// ---- header tags ----
+void test_header_tags(void) {
+    TEST("header_tag");
+    const char *comment = "runid=abc\tbarcode=barcode05 BC:Z:bc05";
+    size_t len = strlen(comment);
+    size_t value_len = 0;
+    const char *value = header_tag(comment, len, "barcode=", 8, &value_len);
+    ASSERT(value && value_len == 9 && memcmp(value, "barcode05", 9) == 0, "tab-separated field");
+    value = header_tag(comment, len, "BC:Z:", 5, &value_len);
+    ASSERT(value && value_len == 4 && memcmp(value, "bc05", 4) == 0, "last field");
+    ASSERT(header_tag(comment, len, "abc", 3, &value_len) == NULL, "key must start a field");
+    value = header_tag(comment, len, "barcode", 7, &value_len);
+    ASSERT(value && value_len == 9 && memcmp(value, "barcode05", 9) == 0, "key without its '='");
+    value = header_tag(comment, len, "BC:Z", 4, &value_len);
+    ASSERT(value && value_len == 4 && memcmp(value, "bc05", 4) == 0, "key without its ':'");
+    ASSERT(header_tag(comment, len, "run", 3, &value_len) == NULL, "key must be the whole field name");
+    ASSERT(header_tag(NULL, 0, "barcode=", 8, &value_len) == NULL, "no comment");
+
+    TEST("tag_table");
+    Barcodes barcodes = {0};
+    const char *names[] = { "barcode01", "barcode05", "barcode01" };
+    for (size_t i = 0; i < 3; i++) {
+        Barcode b = { .name = (char *)names[i] };
+        nob_da_append(&barcodes, b);
+    }
+    Tag_Table table;
+    ASSERT(tag_table_init(&table, &barcodes), "table builds");
+    ASSERT(tag_table_lookup(&table, "barcode05", 9) == 1, "name finds its row");
+    ASSERT(tag_table_lookup(&table, "barcode01", 9) == TAG_SHARED, "name of several rows is shared");
+    ASSERT(tag_table_lookup(&table, "barcode0", 8) == -1, "prefix of a name is unknown");
+    ASSERT(tag_table_lookup(&table, "unclassified", 12) == -1, "unknown name");
+    tag_table_free(&table);
+    nob_da_free(barcodes);
+}
+
+// ---- fastq_append_record ----
+void test_fastq_append_record(void) {
+    TEST("fastq_append_record");
+
+    Nob_String_Builder buf = {0};
+    fastq_append_record(&buf, "r1", 2, "ACGT", "!!##", 4);
+    ASSERT(buf.count == 16 && memcmp(buf.items, "@r1\nACGT\n+\n!!##\n", 16) == 0, "fastq record");
+
+    buf.count = 0;
+    fastq_append_record(&buf, "r2", 2, "AC", NULL, 2);
+    ASSERT(buf.count == 7 && memcmp(buf.items, "@r2\nAC\n", 7) == 0, "no qual writes header and sequence only");
+
+    // multi-megabase reads are copied whole
+    size_t len = 5*1000*1000;
+    char *seq = malloc(len);
+    char *qual = malloc(len);
+    memset(seq, 'G', len);
+    memset(qual, 'I', len);
+    seq[len - 1] = 'T';
+    qual[len - 1] = '#';
+    buf.count = 0;
+    fastq_append_record(&buf, "long", 4, seq, qual, len);
+    ASSERT(buf.count == 2*len + 10, "long record length");
+    ASSERT(buf.items[6 + len - 1] == 'T' && buf.items[buf.count - 2] == '#', "long record is not truncated");
+
+    free(seq);
+    free(qual);
+    nob_sb_free(buf);
+}
+
+// ---- bgzf ----
+void test_bgzf(void) {
+    TEST("bgzf");
+
+    const char *path = "/tmp/nanosweet_test_bgzf.fq.gz";
+    size_t len = 3*BGZF_BLOCK_SIZE + 1234;
+    char *data = malloc(len);
+    random_sequence(data, len, "ACGT\n", 5);
+
+    threadpool pool = thpool_init(2);
+    Bgzf_Writer *w = bgzf_open(path, "wb", pool, true);
+    ASSERT(w != NULL, "writer opens");
+    bool ok = true;
+    for (size_t i = 0; i < len; i += 1000) {
+        ok = ok && bgzf_write(w, data + i, len - i < 1000 ? len - i : 1000);
+    }
+    ASSERT(ok, "writes succeed");
+    ASSERT(bgzf_close(w), "close succeeds");
+
+    // appending adds members to the same gzip stream
+    w = bgzf_open(path, "ab", NULL, false);
+    ASSERT(bgzf_write(w, "tail", 4) && bgzf_close(w), "append succeeds");
+    thpool_destroy(pool);
+
+    char *back = malloc(len + 16);
+    gzFile gz = gzopen(path, "r");
+    int n = gzread(gz, back, (unsigned)(len + 16));
+    gzclose(gz);
+    ASSERT(n == (int)len + 4, "gunzip sees every byte");
+    ASSERT(memcmp(back, data, len) == 0 && memcmp(back + len, "tail", 4) == 0, "content round-trips in order");
+
+    // the index lists the starts of every block after the first
+    char gzi_path[FILE_CAP];
+    snprintf(gzi_path, sizeof(gzi_path), "%s.gzi", path);
+    FILE *fp = fopen(gzi_path, "rb");
+    uint64_t count = 0;
+    ASSERT(fp && fread(&count, sizeof(count), 1, fp) == 1, "index readable");
+    ASSERT(count == 3, "index has one entry per block boundary");
+    if (fp) fclose(fp);
+
+    remove(path);
+    remove(gzi_path);
+    free(data);
+    free(back);
+}
+
 // ---- parse_csv_headers ----
 void test_parse_csv_headers(void) {
     TEST("parse_csv_headers");
@@ -118,6 +774,10 @@ void test_is_fastq(void) {
     ASSERT(is_fastq("reads.fq.gz") == true, ".fq.gz -> true");
     ASSERT(is_fastq("reads.fastq.gz") == true, ".fastq.gz -> true");
     ASSERT(is_fastq("reads.txt") == false, ".txt -> false");
+    ASSERT(is_fastq("reads.fq.gz.gzi") == false, ".fq.gz.gzi -> false");
+    ASSERT(is_fastq("reads.fastq.gz.gzi") == false, ".fastq.gz.gzi -> false");
+    ASSERT(is_fastq("fq_notes.txt") == false, "fq in the name only -> false");
+    ASSERT(is_fastq("reads.gz") == false, ".gz alone -> false");
 }
 
 // ---- average_qual ----
@@ -139,6 +799,20 @@ void test_average_qual(void) {
     const char *quals3 = "5555555555";
     q = average_qual(quals3, 10);
     ASSERT(fabs(q - 20.0) < 0.01, "uniform quality 5 -> Phred ~20");
+
+    // The table and the vector kernel agree with the direct formula
+    char mixed[1003];
+    for (size_t i = 0; i < sizeof(mixed); i++) mixed[i] = (char)(33 + next_rand() % 94);
+    double expected = 0.0;
+    for (size_t i = 0; i < sizeof(mixed); i++) expected += pow(10.0, (mixed[i] - 33) / -10.0);
+    bool sums_match = true;
+    for (Simd_Level level = SIMD_SCALAR; level <= simd_level_detect(); level++) {
+        double sum = phred_error_sum_level(mixed, sizeof(mixed), level);
+        if (fabs(sum - expected) > 1e-9 * expected) sums_match = false;
+    }
+    ASSERT(sums_match, "phred_error_sum matches pow() at every SIMD level");
+    ASSERT(fabs(average_qual(mixed, sizeof(mixed)) - log10(expected / sizeof(mixed)) * -10.0) < 1e-9,
+           "average_qual matches the direct formula");
 }
 
 // ---- slice ----
@@ -168,6 +842,8 @@ void test_min(void) {
     ASSERT(min(5, 5, 5) == 5, "min(5,5,5) = 5");
     ASSERT(min(-1, 0, 1) == -1, "min(-1,0,1) = -1");
     ASSERT(min(0, -1, 1) == -1, "min(0,-1,1) = -1");
+    ASSERT(min_size(3, 2, 1) == 1, "min_size(3,2,1) = 1");
+    ASSERT(min_size(SIZE_MAX, 7, SIZE_MAX) == 7, "min_size keeps values above INT_MAX");
 }
 
 int main(void) {
@@ -175,7 +851,18 @@ int main(void) {
 
     test_complement();
     test_complement_sequence();
+    test_packed_seq();
     test_levenshtein_distance();
+    test_bit_parallel_distance();
+    test_pattern_set_search();
+    test_iupac_patterns();
+    test_barcode_distance();
+    test_levenshtein_cutoff();
+    test_fastq_ranges();
+    test_header_tags();
+    test_gz_reader();
+    test_fastq_append_record();
+    test_bgzf();
     test_parse_csv_headers();
     test_is_fastq();
     test_average_qual();